@@ -4,13 +4,14 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <limits.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <signal.h>
 
 #include "libs/client/client.h"
 #include "libs/pixutils/pixutils.h"
+#include "libs/encoder/encoder.h"
 
 #include "libs/threadpool/threadpool.h"
 
@@ -21,26 +22,31 @@
 #include "libs/stb_image/stb_image_resize2.h"
 #include "libs/log/log.h"
 
-#pragma comment(lib, "Ws2_32.lib")
-#pragma comment(lib, "Mswsock.lib")
-#pragma comment(lib, "AdvApi32.lib")
-
 #define DEFAULT_WIDTH 400
 #define DEFAULT_HEIGHT 400
 
 #define DEFAULT_THREAD_COUNT 4
 #define DEFAULT_QUEUE_SIZE 256
+#define DEFAULT_CONNECTION_COUNT 4
 
-SOCKET client;
 // [FUNCTION IMPLEMENTATIONS]
 /**
  * Main function of the program.
- * It loads an image, resizes it, divides it into chunks, and processes each chunk.
+ * It loads an image, resizes it, divides it into tiles, and sends the tiles over every connection.
  * @param argc Number of command-line arguments.
  * @param argv Array of command-line arguments.
  */
 int parse_dimensions(char *dim, int *width, int *height);
+int parse_size(char *size, size_t *bytes);
+int parse_transport_options(char *list, transportOptions *options);
+int parse_sources(char *list, char **sources, int *count);
+void fit_dimensions(int width, int height, int max_width, int max_height, int *fit_width, int *fit_height);
+void select_encoder(const serverCapabilities *capabilities, int tile_pixels, encoderOptions *options);
 threadpool_t* hThreadpool(int thread_count, int queue_size, int flags);
+void handle_stop_signal(int signum);
+
+// Scheduler the signal handler stops, set while tiles are being sent
+static tileScheduler *active_scheduler = NULL;
 
 
 int parse_dimensions(char *dim, int *width, int *height) {
@@ -58,31 +64,193 @@ int parse_dimensions(char *dim, int *width, int *height) {
     return 0;
 }
 
+/**
+ * Parse a byte count with an optional K or M suffix (e.g. 65536, 64K, 4M).
+ * @param size String to parse.
+ * @param bytes Receives the parsed byte count.
+ * @return 0 on success, 1 if the string is not a valid size.
+ */
+int parse_size(char *size, size_t *bytes) {
+    char *suffix;
+    unsigned long long value = strtoull(size, &suffix, 10);
+    if (suffix == size) {
+        log_error("Invalid size format: %s\n", size);
+        return 1;
+    }
+    switch (*suffix) {
+        case 'k':
+        case 'K':
+            value *= 1024;
+            suffix++;
+            break;
+        case 'm':
+        case 'M':
+            value *= 1024 * 1024;
+            suffix++;
+            break;
+    }
+    if (*suffix != '\0') {
+        log_error("Invalid size format: %s\n", size);
+        return 1;
+    }
+    *bytes = (size_t)value;
+    return 0;
+}
+
+/**
+ * Parse a comma separated list of socket options (e.g. nodelay,cork,sndbuf=4M).
+ * @param list String to parse.
+ * @param options Receives the parsed options.
+ * @return 0 on success, 1 if an option is unknown or invalid.
+ */
+int parse_transport_options(char *list, transportOptions *options) {
+    char *token = strtok(list, ",");
+    while (token != NULL) {
+        if (strcmp(token, "nodelay") == 0) {
+            options->noDelay = 1;
+        } else if (strcmp(token, "cork") == 0) {
+            options->cork = 1;
+        } else if (strncmp(token, "sndbuf=", 7) == 0) {
+            size_t bytes;
+            if (parse_size(token + 7, &bytes) != 0 || bytes > INT_MAX) {
+                return 1;
+            }
+            options->sendBuffer = (int)bytes;
+        } else {
+            log_error("Unknown socket option: %s\n", token);
+            return 1;
+        }
+        token = strtok(NULL, ",");
+    }
+    return 0;
+}
+
+/**
+ * Parse a comma separated list of local source addresses (e.g. 10.0.0.2,10.0.0.3,fd00::2).
+ * @param list String to parse, the addresses point into it.
+ * @param sources Receives the addresses, room for MAX_SOURCES of them.
+ * @param count Receives the number of addresses.
+ * @return 0 on success, 1 if there are too many addresses.
+ */
+int parse_sources(char *list, char **sources, int *count) {
+    char *token = strtok(list, ",");
+    *count = 0;
+    while (token != NULL) {
+        if (*count == MAX_SOURCES) {
+            log_error("More than %d source addresses\n", MAX_SOURCES);
+            return 1;
+        }
+        sources[(*count)++] = token;
+        token = strtok(NULL, ",");
+    }
+    return 0;
+}
+
+/**
+ * Scale dimensions to the largest size fitting in a box while keeping their aspect ratio.
+ * @param width Width to scale.
+ * @param height Height to scale.
+ * @param max_width Width of the box.
+ * @param max_height Height of the box.
+ * @param fit_width Receives the scaled width.
+ * @param fit_height Receives the scaled height.
+ */
+void fit_dimensions(int width, int height, int max_width, int max_height, int *fit_width, int *fit_height) {
+    if ((long long)width * max_height > (long long)height * max_width) {
+        *fit_width = max_width;
+        *fit_height = (int)((long long)height * max_width / width);
+    } else {
+        *fit_width = (int)((long long)width * max_height / height);
+        *fit_height = max_height;
+    }
+    if (*fit_width < 1) {
+        *fit_width = 1;
+    }
+    if (*fit_height < 1) {
+        *fit_height = 1;
+    }
+}
+
+/**
+ * Pick the encoding sending the fewest bytes among those the server supports.
+ * Binary PB commands beat everything, then relative coordinates when tiles are large enough
+ * for their OFFSET line to pay off.
+ * @param capabilities What the probe found out about the server.
+ * @param tile_pixels Number of pixels in a tile.
+ * @param options Receives the chosen encoding.
+ */
+void select_encoder(const serverCapabilities *capabilities, int tile_pixels, encoderOptions *options) {
+    options->binary = capabilities->binary;
+    options->relative = !capabilities->binary && capabilities->offset && tile_pixels >= 16;
+    if (!capabilities->alpha && !options->alphaAware) {
+        log_warn("[!] Server does not mention alpha, it may reject rrggbbaa colors sent because of -A\n");
+    }
+    log_info("[*] Selected %s encoding\n", options->binary ? "binary PB" : options->relative ? "relative PX" : "PX");
+}
+
 threadpool_t* hThreadpool(int thread_count, int queue_size, int flags){
     threadpool_t *pool = threadpool_create(thread_count, queue_size, flags);
     if (pool == NULL) {
         log_fatal("Unable to initialize thread pool.");
-        return 1;
+        return NULL;
     }
     log_info("Pool started with %d threads and queue size of %d\n", thread_count, queue_size);
     return pool;
 }
 
+/**
+ * Stop handing out tiles on SIGINT/SIGTERM, so connections finish their current tile and stats get printed.
+ * @param signum The signal received.
+ */
+void handle_stop_signal(int signum) {
+    (void)signum;
+    if (active_scheduler != NULL) {
+        stopScheduler(active_scheduler);
+    }
+}
+
 int main(int argc, char *argv[]) {
-    client = initClient();
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN); // A closed connection should fail its write, not kill the process
+#endif
     int thread_count = DEFAULT_THREAD_COUNT;
+    int connection_count = DEFAULT_CONNECTION_COUNT;
     int queue_size = DEFAULT_QUEUE_SIZE;
+    int pool_flags = 0;
+    size_t buffer_size = DEFAULT_WRITER_SIZE;
+    clientEngine engine = ENGINE_BLOCKING;
+    int zerocopy = 0;
+    transportOptions transport_options = {0};
+    encoderOptions encoder_options = { .alphaAware = 1 };
+    char *compile_path = NULL;
+    int loop = 0;
+    static struct option long_options[] = {
+        {"compile", required_argument, NULL, 'C'},
+        {"loop", no_argument, NULL, 'R'},
+        {NULL, 0, NULL, 0}
+    };
 
     threadpool_t *pool;
-    
+    connectionPool connections;
+
     int opt;
     char *image_path = NULL;
     char *dim = NULL;
-    int width;
-    int height;
+    char *tile_dim = NULL;
+    int tile_width = DEFAULT_TILE_SIZE;
+    int tile_height = DEFAULT_TILE_SIZE;
+    int width = DEFAULT_WIDTH;
+    int height = DEFAULT_HEIGHT;
+    int canvas_width = 0;
+    int canvas_height = 0;
+    int probe = 1;
+    int encoding_forced = 0;
+    serverCapabilities capabilities = {0};
+    char *sources[MAX_SOURCES];
+    int source_count = 0;
     
     // Parse command-line options
-    while ((opt = getopt(argc, argv, "d:t:q:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:t:c:T:q:Lb:e:zo:ArBPus:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'd':
                 dim = optarg;
@@ -90,11 +258,70 @@ int main(int argc, char *argv[]) {
             case 't':
                 thread_count = atoi(optarg);
                 break;
+            case 'c':
+                connection_count = atoi(optarg);
+                break;
+            case 'T':
+                tile_dim = optarg;
+                break;
             case 'q':
                 queue_size = atoi(optarg);
                 break;
+            case 'L':
+                pool_flags |= threadpool_lockfree;
+                break;
+            case 'b':
+                if (parse_size(optarg, &buffer_size) != 0) {
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (parseEngine(optarg, &engine) != 0) {
+                    return 1;
+                }
+                break;
+            case 'z':
+                zerocopy = 1;
+                break;
+            case 'o':
+                if (parse_transport_options(optarg, &transport_options) != 0) {
+                    return 1;
+                }
+                break;
+            case 'A':
+                encoder_options.alphaAware = 0;
+                break;
+            case 'r':
+                encoder_options.relative = 1;
+                encoding_forced = 1;
+                break;
+            case 'B':
+                encoder_options.binary = 1;
+                encoding_forced = 1;
+                break;
+            case 'P':
+                probe = 0;
+                break;
+            case 'u':
+#ifdef _WIN32
+                log_error("[-] UDP is not supported on Windows\n");
+                return 1;
+#endif
+                transport_options.udp = 1;
+                break;
+            case 's':
+                if (parse_sources(optarg, sources, &source_count) != 0) {
+                    return 1;
+                }
+                break;
+            case 'C':
+                compile_path = optarg;
+                break;
+            case 'R':
+                loop = 1;
+                break;
             default:
-                log_error("Usage: %s [-d width:height] [-t threads] <image_path>\n", argv[0]);
+                log_error("Usage: %s [-d width:height] [-t threads] [-c connections] [-T tile_width:tile_height] [-q queue_size] [-L] [-b buffer_size] [-e blocking|epoll|uring] [-z] [-o nodelay,cork,sndbuf=size] [-A] [-r] [-B] [-P] [-u] [-s source,...] [--compile out.cflf] [--loop] <image_path|frame.cflf>\n", argv[0]);
                 return 1;
         }
     }
@@ -102,7 +329,7 @@ int main(int argc, char *argv[]) {
     if (optind < argc) {
         image_path = argv[optind];
     } else {
-        log_error("Usage: %s [-d width:height] [-t threads] <image_path>\n", argv[0]);
+        log_error("Usage: %s [-d width:height] [-t threads] [-c connections] [-T tile_width:tile_height] [-q queue_size] [-L] [-b buffer_size] [-e blocking|epoll|uring] [-z] [-o nodelay,cork,sndbuf=size] [-A] [-r] [-B] [-P] [-u] [-s source,...] [--compile out.cflf] [--loop] <image_path|frame.cflf>\n", argv[0]);
         return 1;
     }
 
@@ -111,39 +338,214 @@ int main(int argc, char *argv[]) {
         log_error("[-] Dimension is of invalid format or is not provided.");
         return 1;
     }
+    if (encoder_options.binary && encoder_options.relative) {
+        log_warn("[!] -B sends fixed-width coordinates, ignoring -r\n");
+        encoder_options.relative = 0;
+    }
+    if (transport_options.udp) {
+        if (engine != ENGINE_BLOCKING || zerocopy) {
+            log_error("[-] UDP only works with the blocking engine and without -z\n");
+            return 1;
+        }
+        if (encoder_options.relative) {
+            log_warn("[!] A lost OFFSET datagram would misplace the rest of its tile, ignoring -r over UDP\n");
+            encoder_options.relative = 0;
+        }
+    }
+    if (tile_dim != NULL && (parse_dimensions(tile_dim, &tile_width, &tile_height) != 0 || tile_width <= 0 || tile_height <= 0)) {
+        log_error("[-] Tile size is of invalid format.");
+        return 1;
+    }
+    if (thread_count <= 0 || thread_count > MAX_THREADS) {
+        log_error("[-] Thread count must be between 1 and %d\n", MAX_THREADS);
+        return 1;
+    }
+    // Looping tasks never return, so the blocking engine needs a thread per connection and the pool has at most MAX_THREADS
+    if (loop && compile_path == NULL && engine == ENGINE_BLOCKING && connection_count > MAX_THREADS) {
+        log_error("[-] --loop with the blocking engine needs one thread per connection, use at most %d connections or -e epoll|uring\n", MAX_THREADS);
+        return 1;
+    }
+
+    // Connect before loading the image so the size of the canvas can drive the resize.
+    // Compiling a frame sends nothing, so it does not need the server.
+    if (compile_path == NULL) {
+        if (initConnectionPool(&connections, connection_count, &transport_options, sources, source_count) != 0) {
+            log_fatal("[-x-] Unable to open %d connections\n", connection_count);
+            return 1;
+        }
+        transport *first = &connections.connections[0];
+        int res = -1;
+        if (transport_options.udp) {
+            // Answers would come back as datagrams, which cannot be read a byte at a time
+            log_warn("[!] Not probing the server over UDP, use -d to match its canvas\n");
+        } else {
+            res = probe
+                ? probeServer(first, &capabilities)
+                : querySize(first, &capabilities.width, &capabilities.height);
+        }
+        if (res == 0) {
+            canvas_width = capabilities.width;
+            canvas_height = capabilities.height;
+            log_info("[*] Canvas is %dx%d\n", canvas_width, canvas_height);
+        } else if (!transport_options.udp) {
+            log_warn("[!] Server did not report its canvas size, nothing will be clipped\n");
+        }
+        if (capabilities.helpLines > 0) {
+            log_info("[*] Server supports: OFFSET %s, PB %s, alpha %s\n",
+                     capabilities.offset ? "yes" : "no", capabilities.binary ? "yes" : "no",
+                     capabilities.alpha ? "yes" : "no");
+            if (!encoding_forced) {
+                select_encoder(&capabilities, tile_width * tile_height, &encoder_options);
+            } else if ((encoder_options.binary && !capabilities.binary) || (encoder_options.relative && !capabilities.offset)) {
+                log_warn("[!] Server does not mention %s, sending it anyway\n", encoder_options.binary ? "PB" : "OFFSET");
+            }
+        } else if (probe && !transport_options.udp) {
+            log_warn("[!] Server did not answer HELP, keeping the default encoding\n");
+        }
+    }
+
+    frame compiledFrame;
+    if (isFrameFile(image_path)) {
+        // Replay a precompiled frame straight from the page cache
+        if (mapFrame(&compiledFrame, image_path) != 0) {
+            return 1;
+        }
+        if (canvas_width > 0 && (compiledFrame.width > canvas_width || compiledFrame.height > canvas_height)) {
+            log_warn("[!] Frame is %dx%d but the canvas is %dx%d, pixels off the canvas are sent anyway\n",
+                     compiledFrame.width, compiledFrame.height, canvas_width, canvas_height);
+        }
+        if (capabilities.helpLines > 0 &&
+            (((compiledFrame.encoding & FRAME_BINARY) && !capabilities.binary) ||
+             ((compiledFrame.encoding & FRAME_RELATIVE) && !capabilities.offset))) {
+            log_warn("[!] Frame was compiled with %s, which the server does not mention\n",
+                     compiledFrame.encoding & FRAME_BINARY ? "PB commands" : "OFFSET");
+        }
+    } else {
+        image imageStruct = loadImage(image_path);
+        // Without -d the image is fitted into the canvas
+        if (dim == NULL && canvas_width > 0) {
+            fit_dimensions(imageStruct.width, imageStruct.height, canvas_width, canvas_height, &width, &height);
+        }
+        resizeImage(&imageStruct, width, height, DEFAULT_CHANNELS);
+        int tileCount;
+        tile *imageTiles = makeTiles(imageStruct, tile_width, tile_height, &tileCount);
+        if (imageTiles == NULL) {
+            return 1;
+        }
+        if (canvas_width > 0) {
+            tileCount = clipTiles(imageTiles, tileCount, canvas_width, canvas_height);
+        }
+        compiledFrame = compileFrame(imageStruct, imageTiles, tileCount, &encoder_options);
+        // Everything is sent from the compiled frame, the image itself is no longer needed
+        free(imageTiles);
+        stbi_image_free(imageStruct.originalImage);
+        if (compiledFrame.data == NULL) {
+            log_fatal("[-x-] Unable to compile frame\n");
+            return 1;
+        }
+    }
 
-    image imageStruct = loadImage(image_path);
-    resizeImage(&imageStruct, width, height, DEFAULT_CHANNELS);
-    chunk *imageChunks = makeChunks(imageStruct, thread_count);
+    if (compile_path != NULL) {
+        int res = saveFrame(&compiledFrame, compile_path);
+        freeFrame(&compiledFrame);
+        return res != 0;
+    }
 
     int i;
-    pool = hThreadpool(thread_count, queue_size, 0);
+    if (transport_options.udp) {
+        if (compiledFrame.encoding & FRAME_RELATIVE) {
+            log_warn("[!] Frame uses OFFSET, pixels of tiles whose OFFSET datagram is lost will be misplaced\n");
+        }
+        // Binary commands may contain newlines, so their datagrams are cut on whole commands instead
+        for (i = 0; i < connections.count; i++) {
+            connections.connections[i].recordSize = compiledFrame.encoding & FRAME_BINARY ? PB_COMMAND_LENGTH : 0;
+        }
+    }
+    // Looping tasks never return, so every connection needs a thread of its own
+    if (loop && engine == ENGINE_BLOCKING && thread_count < connection_count) {
+        thread_count = connection_count;
+        log_warn("[!] --loop keeps one thread busy per connection, using %d threads\n", thread_count);
+    }
 
-    processArgs* argsArray = malloc(sizeof(processArgs) * thread_count);
+    // Every task owns one connection, so tasks never share a socket.
+    // Tiles are handed out on demand by the scheduler shared between them.
+    tileScheduler scheduler;
+    initScheduler(&scheduler, compiledFrame.tileCount, loop);
+    active_scheduler = &scheduler;
+    signal(SIGINT, handle_stop_signal);
+    signal(SIGTERM, handle_stop_signal);
+    processArgs* argsArray = malloc(sizeof(processArgs) * connection_count);
     if(argsArray == NULL) {
         log_fatal("[-x-] Unable to allocate memory for argsArray\n");
         return 1;
     }
+    for (i=0; i < connection_count; i++) {
+        argsArray[i].frame = &compiledFrame;
+        argsArray[i].scheduler = &scheduler;
+        argsArray[i].client = &connections.connections[i];
+        argsArray[i].bufferSize = buffer_size;
+        argsArray[i].zerocopy = zerocopy;
+    }
 
-    for (i=0; i < thread_count; i++) {
-        argsArray[i].image = imageStruct;
-        argsArray[i].chunk = imageChunks[i];
-        argsArray[i].client = client;
+    if (engine == ENGINE_EPOLL || engine == ENGINE_URING) {
+        payloadSource source = {
+            .base = compiledFrame.data,
+            .size = compiledFrame.size,
+            .next = nextTilePayload,
+            .context = argsArray,
+        };
+        engineStats stats;
+        int res = engine == ENGINE_EPOLL
+            ? runEpollEngine(&connections, &source, &stats)
+            : runUringEngine(&connections, &source, &stats);
+        if (res != 0) {
+            log_error("[-] %s engine failed\n", engine == ENGINE_EPOLL ? "epoll" : "io_uring");
+        }
+    } else {
+        pool = hThreadpool(thread_count, queue_size, pool_flags);
+        if (pool == NULL) {
+            return 1;
+        }
 
-        if (threadpool_add(pool, processChunk, &argsArray[i], 0) != 0) {
-            log_fatal("[-x-] Error adding task for chunk %p", (void*)argsArray[i].chunk.start);
+        // Submit one task per connection in a single batch
+        void** tasks = malloc(sizeof(void*) * connection_count);
+        if (tasks == NULL) {
+            log_fatal("[-x-] Unable to allocate memory for tasks\n");
+            return 1;
+        }
+        for (i=0; i < connection_count; i++) {
+            tasks[i] = &argsArray[i];
+        }
+        threadpool_group_t *frameGroup = threadpool_group_create(pool);
+        if (frameGroup == NULL) {
+            log_fatal("[-x-] Unable to create task group\n");
             return 1;
         }
-        log_info("[*] Processing (%i): %p", i+1, (void*)imageChunks[i].start);
+        // Batches never exceed the queue, and wait for room instead of failing when it is full
+        for (i=0; i < connection_count; i += queue_size) {
+            int batch = connection_count - i < queue_size ? connection_count - i : queue_size;
+            if (threadpool_group_add_batch(frameGroup, processTiles, tasks + i, batch, threadpool_block) != 0) {
+                log_fatal("[-x-] Error adding tasks for %d connections", batch);
+                return 1;
+            }
+        }
+        log_info("[*] Processing (%i)", connection_count);
+        free(tasks);
+
+        // Wait for the frame to be sent, then let the workers finish whatever is left
+        threadpool_group_wait(frameGroup);
+        threadpool_group_destroy(frameGroup);
+        threadpool_destroy(pool, threadpool_graceful);
     }
-    threadpool_destroy(pool, 0);
+    active_scheduler = NULL;
+    double elapsed = schedulerElapsed(&scheduler);
+    unsigned long long passes = schedulerPasses(&scheduler);
+    log_info("[*] %llu passes in %.2fs, %.2f passes/sec\n", passes, elapsed, elapsed > 0 ? passes / elapsed : 0.0);
+
     free(argsArray);
-    free(imageChunks);
+    freeFrame(&compiledFrame);
 
-    stbi_image_free(imageStruct.originalImage);
-    
-    closesocket(client);
-    WSACleanup();
+    closeConnectionPool(&connections);
     
     return 0;
 }
\ No newline at end of file
@@ -1,88 +1,617 @@
 #include <stdio.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
 #include "../log/log.h"
 #include "client.h"
 
-#pragma comment(lib, "Ws2_32.lib")
-#pragma comment(lib, "Mswsock.lib")
-#pragma comment(lib, "AdvApi32.lib")
+/**
+ * Connect to the server through the transport backend of the platform, or the UDP one if the options ask for it.
+ * @param client The transport to connect.
+ * @param options Socket options to apply to the connection.
+ * @return 0 on success, -1 if the connection could not be opened.
+ */
+int initClient(transport *client, const transportOptions *options) {
+    ZeroMemory(client, sizeof(*client));
+#ifdef _WIN32
+    client->ops = defaultTransport();
+#else
+    client->ops = options->udp ? &udpTransport : defaultTransport();
+#endif
+    client->options = *options;
+    client->socket = INVALID_SOCKET;
 
-SOCKET initClient() {
-    WSADATA wsaData;
-    int iResult;
-    iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (iResult != 0) {
-        log_error("WSAStartup() failed: %ld\n", WSAGetLastError());
+    if (client->ops->connect(client, HOST, PORT) != 0) {
+        return -1;
+    }
+    log_info("[*] Connected to server (%s transport)\n", client->ops->name);
+    return 0;
+}
+
+/**
+ * Close a connection opened by initClient.
+ * @param client The transport to close.
+ */
+void closeClient(transport *client) {
+    transportStats stats;
+    client->ops->stats(client, &stats);
+    log_debug("[*] Closing %s connection: %llu bytes in %llu writes, %llu bytes in %llu reads\n",
+              client->ops->name, stats.bytesWritten, stats.writes, stats.bytesRead, stats.reads);
+    if (stats.datagrams > 0) {
+        log_debug("[*] %llu datagrams sent, %.1f per write\n", stats.datagrams, (double)stats.datagrams / stats.writes);
+    }
+    client->ops->close(client);
+}
+
+/**
+ * Pick the source address a connection is bound to, among the sources of the family of its target.
+ * @param sources Numeric local addresses.
+ * @param sourceCount Number of sources.
+ * @param family Address family of the target.
+ * @param turn How many connections to the target came before, to take the sources in turn.
+ * @param unbound Flags of the sources that could not be bound for this target, they are never picked.
+ * @return Index of the source, or -1 if no usable source has the family of the target.
+ */
+static int pickSource(char **sources, int sourceCount, int family, int turn, const char *unbound) {
+    int i, matching = 0;
+    for (i = 0; i < sourceCount; i++) {
+        // Numeric IPv6 addresses are the only ones with a colon
+        matching += !unbound[i] && (strchr(sources[i], ':') != NULL ? AF_INET6 : AF_INET) == family;
+    }
+    if (matching == 0) {
+        return -1;
+    }
+    turn %= matching;
+    for (i = 0; i < sourceCount; i++) {
+        if (!unbound[i] && (strchr(sources[i], ':') != NULL ? AF_INET6 : AF_INET) == family && turn-- == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Open a pool of connections to the server, spread over every address the server resolves to.
+ * Connection i goes to address i % n and is bound to the sources in turn, so every address is
+ * reached from every source. An address that refuses a connection is skipped from then on, while a
+ * source that cannot be bound only stops being used for that address.
+ * @param pool The pool to initialize.
+ * @param count Number of connections to open, between 1 and MAX_CONNECTIONS.
+ * @param options Socket options to apply to every connection.
+ * @param sources Numeric local addresses to bind the connections to, NULL to let the system choose.
+ * @param sourceCount Number of sources.
+ * @return 0 on success, -1 if any connection could not be opened.
+ */
+int initConnectionPool(connectionPool *pool, int count, const transportOptions *options, char **sources, int sourceCount) {
+    const struct addrinfo *targets[MAX_TARGETS];
+    int failed[MAX_TARGETS] = {0};
+    int connected[MAX_TARGETS] = {0};
+    char unbound[MAX_TARGETS][MAX_SOURCES] = {{0}};
+    int targetCount = 0, k;
+    struct addrinfo *addresses = NULL, *it;
+    char host[INET6_ADDRSTRLEN];
+
+    pool->connections = NULL;
+    pool->count = 0;
+    if (count <= 0 || count > MAX_CONNECTIONS) {
+        log_error("[!] Invalid connection count: %d\n", count);
+        return -1;
+    }
+
+    pool->connections = (transport*)malloc(count * sizeof(transport));
+    if (pool->connections == NULL) {
+        log_error("[!] Unable to allocate memory for %d connections\n", count);
+        return -1;
+    }
+    if (resolveHost(HOST, PORT, options->udp ? SOCK_DGRAM : SOCK_STREAM, &addresses) != 0) {
+        closeConnectionPool(pool);
+        return -1;
+    }
+    for (it = addresses; it != NULL && targetCount < MAX_TARGETS; it = it->ai_next) {
+        targets[targetCount++] = it;
+    }
+
+    for (pool->count = 0; pool->count < count; pool->count++) {
+        int i = pool->count, res = -1;
+        for (k = 0; k < targetCount && res != 0; k++) {
+            int t = (i + k) % targetCount;
+            while (!failed[t] && res != 0) {
+                transportOptions connection = *options;
+                int source = pickSource(sources, sourceCount, targets[t]->ai_family, connected[t], unbound[t]);
+                if (sourceCount > 0 && source < 0) {
+                    break; // No source left to reach this address from
+                }
+                connection.target = targets[t];
+                connection.source = source >= 0 ? sources[source] : NULL;
+                res = initClient(&pool->connections[i], &connection);
+                formatAddress(targets[t]->ai_addr, targets[t]->ai_addrlen, host, sizeof(host));
+                if (res == 0) {
+                    connected[t]++;
+                } else if (pool->connections[i].bindFailed) {
+                    // The address may still be reachable from the other sources
+                    unbound[t][source] = 1;
+                    log_warn("[!] Unable to bind to %s for %s, trying another source\n", sources[source], host);
+                } else {
+                    failed[t] = 1;
+                    log_warn("[!] Unable to connect to %s%s%s, skipping it\n",
+                             host, connection.source != NULL ? " from " : "", connection.source != NULL ? connection.source : "");
+                }
+            }
+        }
+        if (res != 0) {
+            log_error("[!] No address left to open connection %d to\n", i);
+            freeAddresses(addresses);
+            closeConnectionPool(pool);
+            return -1;
+        }
+        // The address only lives as long as the list it was resolved in
+        pool->connections[i].options.target = NULL;
+    }
+
+    for (k = 0; k < targetCount; k++) {
+        if (connected[k] > 0) {
+            formatAddress(targets[k]->ai_addr, targets[k]->ai_addrlen, host, sizeof(host));
+            log_info("[*] %d connections to %s\n", connected[k], host);
+        }
+    }
+    freeAddresses(addresses);
+    log_info("[*] Opened %d connections\n", pool->count);
+    return 0;
+}
+
+/**
+ * Close every connection of a pool and release it.
+ * @param pool The pool to close.
+ */
+void closeConnectionPool(connectionPool *pool) {
+    int i;
+    for (i = 0; i < pool->count; i++) {
+        closeClient(&pool->connections[i]);
+    }
+    free(pool->connections);
+    pool->connections = NULL;
+    pool->count = 0;
+}
+
+/**
+ * Send a whole buffer, retrying after short writes until every byte has been written.
+ * @param client Transport to send on.
+ * @param buffer Bytes to send.
+ * @param length Number of bytes to send.
+ * @param stats Optional stats to account the bytes and send() calls to.
+ * @return 0 on success, or SOCKET_ERROR on failure.
+ */
+static int sendAll(transport *client, const char* buffer, size_t length, flushStats *stats) {
+    size_t sent = 0;
+    while (sent < length) {
+        long long res = client->ops->write(client, buffer + sent, length - sent);
+        if (stats != NULL) {
+            stats->syscalls++;
+        }
+        if (res == SOCKET_ERROR) {
+            log_error("[!] %s write failed: %ld\n", client->ops->name, WSAGetLastError());
+            return SOCKET_ERROR;
+        }
+        sent += res;
+        if (stats != NULL) {
+            stats->bytes += res;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Send a gather list whole, retrying after short writes until every slice has been written.
+ * @param client Transport to send on.
+ * @param slices Slices to send, consumed as they are sent.
+ * @param count Number of slices.
+ * @param stats Optional stats to account the bytes and writev() calls to.
+ * @return 0 on success, or SOCKET_ERROR on failure.
+ */
+static int sendAllSlices(transport *client, ioSlice *slices, int count, flushStats *stats) {
+    while (count > 0) {
+        long long res = client->ops->writev(client, slices, count);
+        if (stats != NULL) {
+            stats->syscalls++;
+        }
+        if (res == SOCKET_ERROR) {
+            log_error("[!] %s writev failed: %ld\n", client->ops->name, WSAGetLastError());
+            return SOCKET_ERROR;
+        }
+        if (stats != NULL) {
+            stats->bytes += res;
+        }
+        // Skip what was written, the first slice left may have been written in part
+        while (count > 0 && (size_t)res >= slices->length) {
+            res -= slices->length;
+            slices++;
+            count--;
+        }
+        if (count > 0) {
+            slices->data += res;
+            slices->length -= res;
+        }
+    }
+    return 0;
+}
+
+void sendMessage(transport *client, char* message) {
+    sendAll(client, message, strlen(message), NULL);
+}
+
+/**
+ * Send a whole buffer, retrying until every byte has been written.
+ * @param client Transport to send on.
+ * @param buffer Bytes to send.
+ * @param length Number of bytes to send.
+ * @return 0 on success, or SOCKET_ERROR on failure.
+ */
+int sendBuffer(transport *client, const char* buffer, size_t length) {
+    return sendAll(client, buffer, length, NULL);
+}
+
+/**
+ * Initialize a buffered writer for a connection.
+ * @param writer The writer to initialize.
+ * @param client Transport the writer sends on.
+ * @param capacity Size of the buffer in bytes, clamped to [MIN_WRITER_SIZE, MAX_WRITER_SIZE].
+ * @return 0 on success, -1 if the buffer could not be allocated.
+ */
+int initWriter(writer *writer, transport *client, size_t capacity) {
+    if (capacity < MIN_WRITER_SIZE) {
+        capacity = MIN_WRITER_SIZE;
+    } else if (capacity > MAX_WRITER_SIZE) {
+        capacity = MAX_WRITER_SIZE;
+    }
+
+    ZeroMemory(writer, sizeof(*writer));
+    writer->buffer = (char*)malloc(capacity);
+    if (writer->buffer == NULL) {
+        log_error("[!] Unable to allocate a %zu byte writer buffer\n", capacity);
+        return -1;
+    }
+    writer->client = client;
+    writer->capacity = capacity;
+    writer->threshold = capacity;
+    return 0;
+}
+
+/**
+ * Append data to a writer, flushing whenever the buffer fills up or the threshold is reached.
+ * Data that is at least as large as the buffer is sent directly instead of being copied.
+ * @param writer The writer to append to.
+ * @param data Bytes to append.
+ * @param length Number of bytes to append.
+ * @return 0 on success, or SOCKET_ERROR if a send failed.
+ */
+int writerAppend(writer *writer, const char* data, size_t length) {
+    // Gathered slices go first, so data leaves in the order it was handed over
+    if (writer->gatheredCount > 0 && writerFlush(writer) == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+    if (writer->length + length > writer->capacity && writerFlush(writer) == SOCKET_ERROR) {
+        return SOCKET_ERROR;
     }
-    struct addrinfo *result = NULL,
-                    *ptr = NULL,
-                    hints;
-    ZeroMemory(&hints, sizeof(hints));
-    hints.ai_family   = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
 
-    iResult = getaddrinfo(HOST, PORT, &hints, &result);
-    if (iResult != 0) {
-        log_fatal("[!] getaddrinfo failed: %d", iResult);
-        WSACleanup();
-        return 1;
+    if (length >= writer->capacity) {
+        ZeroMemory(&writer->last, sizeof(writer->last));
+        int res = sendAll(writer->client, data, length, &writer->last);
+        writer->total.bytes += writer->last.bytes;
+        writer->total.syscalls += writer->last.syscalls;
+        return res;
     }
 
-    SOCKET clientSocket = INVALID_SOCKET;
-    ptr = result;
-    clientSocket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-    if (clientSocket == INVALID_SOCKET) {
-        log_fatal("[!] Error at socket(): %ld\n", WSAGetLastError());
-        freeaddrinfo(result);
-        WSACleanup();
-        return 1;
+    memcpy(writer->buffer + writer->length, data, length);
+    writer->length += length;
+    if (writer->length >= writer->threshold) {
+        return writerFlush(writer);
     }
+    return 0;
+}
 
-    iResult = connect(clientSocket, ptr->ai_addr, (int)ptr->ai_addrlen);
-    if (iResult == SOCKET_ERROR) {
-        closesocket(clientSocket);
-        clientSocket = INVALID_SOCKET;
+/**
+ * Send everything waiting in a writer's buffer or gather list.
+ * The cost of the flush is stored in `writer->last` and added to `writer->total`.
+ * @param writer The writer to flush.
+ * @return 0 on success, or SOCKET_ERROR if a send failed.
+ */
+int writerFlush(writer *writer) {
+    ZeroMemory(&writer->last, sizeof(writer->last));
+    if (writer->gatheredCount > 0) {
+        int res = sendAllSlices(writer->client, writer->gathered, writer->gatheredCount, &writer->last);
+        writer->gatheredCount = 0;
+        writer->gatheredBytes = 0;
+        writer->total.bytes += writer->last.bytes;
+        writer->total.syscalls += writer->last.syscalls;
+        log_debug("[*] Flushed %llu gathered bytes in %llu writev() calls\n", writer->last.bytes, writer->last.syscalls);
+        return res;
+    }
+    if (writer->length == 0) {
+        return 0;
     }
 
-    freeaddrinfo(result);
-    if (clientSocket == INVALID_SOCKET) {
-        log_fatal("[!] Unable to connect to server!\n");
-        WSACleanup();
-        return 1;
+    int res = sendAll(writer->client, writer->buffer, writer->length, &writer->last);
+    writer->length = 0;
+    writer->total.bytes += writer->last.bytes;
+    writer->total.syscalls += writer->last.syscalls;
+    log_debug("[*] Flushed %llu bytes in %llu send() calls\n", writer->last.bytes, writer->last.syscalls);
+    return res;
+}
+
+/**
+ * Send data that stays alive and unchanged for the lifetime of the writer, like a compiled frame.
+ * Buffered data is flushed first. With zero-copy enabled the data is sent with MSG_ZEROCOPY,
+ * otherwise it is added to the gather list without being copied. The list is sent with writev
+ * once it holds MAX_IO_SLICES slices or reaches the flush threshold.
+ * @param writer The writer to send on.
+ * @param data Bytes to send.
+ * @param length Number of bytes to send.
+ * @return 0 on success, or SOCKET_ERROR if a send failed.
+ */
+int writerSendPinned(writer *writer, const char* data, size_t length) {
+    if (!writer->zerocopy) {
+        if (writer->length > 0 && writerFlush(writer) == SOCKET_ERROR) {
+            return SOCKET_ERROR;
+        }
+        writer->gathered[writer->gatheredCount].data = data;
+        writer->gathered[writer->gatheredCount].length = length;
+        writer->gatheredCount++;
+        writer->gatheredBytes += length;
+        if (writer->gatheredCount == MAX_IO_SLICES || writer->gatheredBytes >= writer->threshold) {
+            return writerFlush(writer);
+        }
+        return 0;
     }
-    log_info("[*] Connected to server\n");
 
-    return clientSocket;
+    if (writerFlush(writer) == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+
+    ZeroMemory(&writer->last, sizeof(writer->last));
+    int res = sendZeroCopy(writer->client->socket, data, length, &writer->pinned, &writer->last);
+    writer->total.bytes += writer->last.bytes;
+    writer->total.syscalls += writer->last.syscalls;
+    return res;
 }
 
-void sendMessage(SOCKET client, char* message) {
-    char buffer[DEFAULT_BUFFER];
-    ZeroMemory(buffer, sizeof(buffer));
-    strncpy(buffer, message, sizeof(buffer) - 1); // Copy message to buffer
+/**
+ * Send pinned data of a writer with MSG_ZEROCOPY from now on.
+ * @param writer The writer to enable zero-copy sends on.
+ * @return 0 on success, -1 if the connection does not support it.
+ */
+int writerEnableZeroCopy(writer *writer) {
+    if (enableZeroCopy(writer->client->socket) != 0) {
+        return -1;
+    }
+    writer->zerocopy = 1;
+    return 0;
+}
 
-    int res = send(client, buffer, strlen(buffer), 0);
+/**
+ * Release the buffer of a writer. Pending data is discarded, flush first to keep it.
+ * Outstanding zero-copy sends are waited for, so pinned data may be released afterwards.
+ * @param writer The writer to free.
+ */
+void freeWriter(writer *writer) {
+    if (writer->zerocopy) {
+        drainZeroCopy(writer->client->socket, &writer->pinned);
+    }
+    free(writer->buffer);
+    writer->buffer = NULL;
+    writer->capacity = writer->length = 0;
+}
+
+/**
+ * Parse the name of an engine.
+ * @param name Name of the engine, "blocking", "epoll" or "uring".
+ * @param engine Receives the parsed engine.
+ * @return 0 on success, -1 if the engine is unknown or not available on this platform.
+ */
+int parseEngine(const char *name, clientEngine *engine) {
+    if (strcmp(name, "blocking") == 0) {
+        *engine = ENGINE_BLOCKING;
+        return 0;
+    }
+#ifdef __linux__
+    if (strcmp(name, "epoll") == 0) {
+        *engine = ENGINE_EPOLL;
+        return 0;
+    }
+    if (strcmp(name, "uring") == 0) {
+        *engine = ENGINE_URING;
+        return 0;
+    }
+#endif
+    log_error("[!] Unknown or unsupported engine: %s\n", name);
+    return -1;
+}
+
+/**
+ * Read one line sent by the server, without consuming anything after its newline.
+ * The line is read byte by byte, which is only meant for the few responses of a handshake.
+ * Lines longer than the buffer are truncated, the rest of them is discarded.
+ * @param client Transport to read from.
+ * @param line Receives the line, without its trailing "\r\n" and null-terminated.
+ * @param capacity Size of the line buffer in bytes.
+ * @param timeout Milliseconds to wait for each byte, a negative value waits forever.
+ * @return Length of the line, or SOCKET_ERROR on timeout, failure or closed connection.
+ */
+int receiveLine(transport *client, char *line, size_t capacity, int timeout) {
+    size_t length = 0;
+    char c;
+
+    for (;;) {
+        int ready = waitReadable(client->socket, timeout);
+        if (ready == 0) {
+            log_warn("[!] No response from server within %d ms\n", timeout);
+            return SOCKET_ERROR;
+        }
+        long long res = ready == SOCKET_ERROR ? SOCKET_ERROR : client->ops->read(client, &c, 1);
+        if (res == 0) {
+            log_error("[!] Connection closed\n");
+            return SOCKET_ERROR;
+        }
+        if (res == SOCKET_ERROR) {
+            log_error("[!] %s read failed: %ld\n", client->ops->name, WSAGetLastError());
+            return SOCKET_ERROR;
+        }
+        if (c == '\n') {
+            break;
+        }
+        if (length + 1 < capacity) {
+            line[length++] = c;
+        }
+    }
+    if (length > 0 && line[length - 1] == '\r') {
+        length--;
+    }
+    line[length] = '\0';
+    return (int)length;
+}
+
+/**
+ * Read one line sent by the server.
+ * @param client Transport to read from.
+ * @return The line without its newline, to be freed by the caller, or NULL if none arrived
+ * within RESPONSE_TIMEOUT milliseconds.
+ */
+char* receiveMessage(transport *client) {
+    char buffer[MAX_RESPONSE_LENGTH];
+    int res = receiveLine(client, buffer, sizeof(buffer), RESPONSE_TIMEOUT);
     if (res == SOCKET_ERROR) {
-        log_fatal("[!] send() failed: %ld\n", WSAGetLastError());
+        return NULL;
+    }
+    log_debug("[+] Received: %s\n", buffer);
+    return strdup(buffer);
+}
+
+/**
+ * Ask the server for the size of its canvas.
+ * @param client Transport to ask on, nothing else may be waiting to be read on it.
+ * @param width Receives the width of the canvas.
+ * @param height Receives the height of the canvas.
+ * @return 0 on success, -1 if the server did not answer with a valid "SIZE <w> <h>".
+ */
+int querySize(transport *client, int *width, int *height) {
+    if (sendBuffer(client, "SIZE\n", 5) != 0) {
+        return -1;
+    }
+    char *response = receiveMessage(client);
+    if (response == NULL) {
+        return -1;
+    }
+
+    int w, h;
+    int res = sscanf(response, "SIZE %d %d", &w, &h) == 2 && w > 0 && h > 0 ? 0 : -1;
+    if (res == 0) {
+        *width = w;
+        *height = h;
+    } else {
+        log_warn("[!] Unexpected answer to SIZE: %s\n", response);
+    }
+    free(response);
+    return res;
+}
+
+/**
+ * Check whether a line of HELP text lists a command.
+ * The command must be the first token of the line, after any indentation or bullet such as "-" or ">",
+ * or one of the tokens of a "Commands: PX, SIZE, ..." listing. It may be followed by its arguments,
+ * a colon, or lowercase placeholders as in "PBxxyyrgba", but never by more of a longer uppercase word.
+ * Prose merely containing the command name does not count.
+ * @param line The line to search.
+ * @param command The command name, in uppercase.
+ * @return 1 if the line lists the command, 0 otherwise.
+ */
+static int listsCommand(const char *line, const char *command) {
+    const char *listing = "commands";
+    size_t length = strlen(command), i;
+    const char *it = line;
+    while (*it != '\0' && (isspace((unsigned char)*it) || ispunct((unsigned char)*it))) {
+        it++;
+    }
+    for (i = 0; listing[i] != '\0' && tolower((unsigned char)it[i]) == listing[i]; i++);
+    if (listing[i] == '\0') {
+        const char *colon = it + i;
+        while (*colon == ' ' || *colon == '\t') {
+            colon++;
+        }
+        if (*colon == ':') {
+            // A listing, every token separated by commas or spaces is a command
+            it = colon + 1;
+            while (*it != '\0') {
+                while (*it != '\0' && !isalnum((unsigned char)*it)) {
+                    it++;
+                }
+                if (strncmp(it, command, length) == 0 && !isalnum((unsigned char)it[length])) {
+                    return 1;
+                }
+                while (isalnum((unsigned char)*it)) {
+                    it++;
+                }
+            }
+            return 0;
+        }
+    }
+    return strncmp(it, command, length) == 0 && !isupper((unsigned char)it[length]) && !isdigit((unsigned char)it[length]);
+}
+
+/**
+ * Look for the features a line of HELP text advertises.
+ * Servers word their help freely, so this only relies on the command names they list and the color
+ * formats given for PX, never on words found in the prose around them.
+ * @param line A line of HELP text.
+ * @param capabilities Receives the features found.
+ */
+static void parseHelpLine(const char *line, serverCapabilities *capabilities) {
+    char lower[MAX_RESPONSE_LENGTH];
+    size_t i;
+    for (i = 0; line[i] != '\0' && i + 1 < sizeof(lower); i++) {
+        lower[i] = (char)tolower((unsigned char)line[i]);
+    }
+    lower[i] = '\0';
+
+    if (listsCommand(line, "OFFSET")) {
+        capabilities->offset = 1;
+    }
+    if (listsCommand(line, "PB")) {
+        capabilities->binary = 1;
+    }
+    if (listsCommand(line, "PX") && (strstr(lower, "rrggbbaa") != NULL || strstr(lower, "rrggbb(aa)") != NULL)) {
+        capabilities->alpha = 1;
     }
 }
 
-char* receiveMessage(SOCKET client) {
-    char buffer[DEFAULT_BUFFER];
-    int res = recv(client, buffer, sizeof(buffer) - 1, 0);
+/**
+ * Ask the server for its HELP text and canvas size, and detect which features it supports.
+ * SIZE is sent right after HELP, so its answer marks the end of the HELP text however many lines it has.
+ * @param client Transport to ask on, nothing else may be waiting to be read on it.
+ * @param capabilities Receives what the server supports, features it did not mention are left unset.
+ * @return 0 on success, -1 if the server did not answer SIZE.
+ */
+int probeServer(transport *client, serverCapabilities *capabilities) {
+    char line[MAX_RESPONSE_LENGTH];
+    int i;
 
-    if (res > 0) {
-        buffer[res] = '\0'; // Null-terminate received data
-        log_info("[*] Bytes received: %d\n", res);
-        log_info("[+] Received: %s", buffer);
-    } 
-    else if (res == 0) {
-        log_error("[!] Connection closed\n");
-    } 
-    else {
-        log_error("[!] recv() failed: %ld\n", WSAGetLastError());
+    ZeroMemory(capabilities, sizeof(*capabilities));
+    if (sendBuffer(client, "HELP\nSIZE\n", 10) != 0) {
+        return -1;
     }
-    
-    
-}
\ No newline at end of file
+    for (i = 0; i < MAX_PROBE_LINES; i++) {
+        if (receiveLine(client, line, sizeof(line), RESPONSE_TIMEOUT) == SOCKET_ERROR) {
+            return -1;
+        }
+        int w, h;
+        if (sscanf(line, "SIZE %d %d", &w, &h) == 2 && w > 0 && h > 0) {
+            capabilities->width = w;
+            capabilities->height = h;
+            return 0;
+        }
+        log_debug("[+] HELP: %s\n", line);
+        capabilities->helpLines++;
+        parseHelpLine(line, capabilities);
+    }
+    log_warn("[!] HELP text longer than %d lines, giving up on SIZE\n", MAX_PROBE_LINES);
+    return -1;
+}
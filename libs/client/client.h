@@ -2,19 +2,146 @@
 #define CLIENT_H_
 
 #include <stdio.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-
-#pragma comment(lib, "Ws2_32.lib")
-#pragma comment(lib, "Mswsock.lib")
-#pragma comment(lib, "AdvApi32.lib")
+#include <stddef.h>
+#include "transport.h"
 
 #define HOST "pixelflut.uwu.industries"
 #define PORT "1234"
-#define DEFAULT_BUFFER 30
+#define MAX_RESPONSE_LENGTH 1024 // Longest server response line kept, longer ones are truncated
+#define RESPONSE_TIMEOUT 2000    // Milliseconds to wait for the server to answer a query
+#define MAX_PROBE_LINES 256      // Lines of HELP text read at most while probing
+
+#define DEFAULT_WRITER_SIZE (64 * 1024)
+#define MIN_WRITER_SIZE (4 * 1024)
+#define MAX_WRITER_SIZE (64 * 1024 * 1024)
+
+/**
+ * Structure to represent the cost of flushing a writer.
+ */
+typedef struct {
+    unsigned long long bytes;
+    unsigned long long syscalls;
+} flushStats;
+
+/**
+ * Structure to represent the outcome of MSG_ZEROCOPY sends on a connection.
+ * Once completed, a send either really was zero-copy or the kernel fell back to copying it.
+ */
+typedef struct {
+    unsigned long long sends;      // send() calls made with MSG_ZEROCOPY
+    unsigned long long completed;  // Sends whose completion notification was reaped
+    unsigned long long zerocopied; // Completed sends that were transmitted from the pinned pages
+    unsigned long long copied;     // Completed sends the kernel copied after all
+} zerocopyStats;
+
+/**
+ * Structure to represent a buffered writer owning one connection.
+ * Appended data is collected in the buffer and sent once it reaches the flush threshold.
+ * Pinned data is not copied: its slices are gathered and sent together with a single writev.
+ */
+typedef struct {
+    transport *client;
+    char *buffer;
+    size_t capacity;  // Size of the buffer in bytes
+    size_t length;    // Number of bytes waiting in the buffer
+    size_t threshold; // Flush as soon as length reaches this many bytes
+    flushStats last;  // Cost of the most recent flush
+    flushStats total; // Cost of every flush so far
+    int zerocopy;     // Set if pinned data is sent with MSG_ZEROCOPY
+    zerocopyStats pinned;
+    ioSlice gathered[MAX_IO_SLICES]; // Pinned data waiting to be sent, only while the buffer is empty
+    int gatheredCount;
+    size_t gatheredBytes;
+} writer;
+
+/**
+ * Structure to represent what a server told about itself in its answers to HELP and SIZE.
+ */
+typedef struct {
+    int width, height; // Size of the canvas, 0 if the server did not answer SIZE
+    int helpLines;     // Lines of HELP text received, 0 if the server does not answer HELP
+    int offset;        // OFFSET is supported
+    int binary;        // Binary PB commands are supported
+    int alpha;         // rrggbbaa colors are supported
+} serverCapabilities;
+
+#define MAX_CONNECTIONS 1024
+#define MAX_TARGETS 64 // Resolved server addresses a pool spreads its connections over
+#define MAX_SOURCES 64 // Local source addresses a pool binds its connections to
+
+/**
+ * Structure to represent a pool of connections to the server.
+ * Each connection is owned by exactly one task at a time so their PX lines never interleave.
+ */
+typedef struct {
+    transport *connections;
+    int count;
+} connectionPool;
+
+/**
+ * Engines that can drive the connections of a pool.
+ * ENGINE_BLOCKING runs one blocking task per connection on the thread pool,
+ * ENGINE_EPOLL drives every connection from a single non-blocking event loop (Linux only),
+ * ENGINE_URING submits the writes of every connection in batches through io_uring (Linux only).
+ */
+typedef enum {
+    ENGINE_BLOCKING,
+    ENGINE_EPOLL,
+    ENGINE_URING
+} clientEngine;
+
+/**
+ * Callback used by the event-driven engines to fetch the next payload of a connection.
+ * @param connection Index of the connection in its pool.
+ * @param data Receives a pointer to the payload.
+ * @param length Receives the length of the payload in bytes.
+ * @param context The context of the `payloadSource`.
+ * @return 1 if a payload was stored, 0 once the connection has nothing left to send.
+ */
+typedef int (*nextPayloadFn)(int connection, const char **data, size_t *length, void *context);
+
+/**
+ * Structure to represent where an engine gets its payloads from.
+ * Every payload must point into [base, base + size), e.g. the data of a compiled frame.
+ */
+typedef struct {
+    const char *base;
+    size_t size;
+    nextPayloadFn next;
+    void *context;
+} payloadSource;
+
+/**
+ * Structure to represent the work done by an engine.
+ */
+typedef struct {
+    unsigned long long bytes;
+    unsigned long long syscalls; // send() calls, including those that would have blocked
+    unsigned long long wakeups;  // Returns from waiting on the event loop
+} engineStats;
 
-SOCKET initClient();
-void sendMessage(SOCKET client, char* message);
-char* receiveMessage(SOCKET client);
+int initClient(transport *client, const transportOptions *options);
+void closeClient(transport *client);
+int initConnectionPool(connectionPool *pool, int count, const transportOptions *options, char **sources, int sourceCount);
+void closeConnectionPool(connectionPool *pool);
+void sendMessage(transport *client, char* message);
+int sendBuffer(transport *client, const char* buffer, size_t length);
+int initWriter(writer *writer, transport *client, size_t capacity);
+int writerAppend(writer *writer, const char* data, size_t length);
+int writerFlush(writer *writer);
+int writerEnableZeroCopy(writer *writer);
+int writerSendPinned(writer *writer, const char* data, size_t length);
+void freeWriter(writer *writer);
+int enableZeroCopy(SOCKET client);
+int sendZeroCopy(SOCKET client, const char* buffer, size_t length, zerocopyStats *stats, flushStats *flush);
+int reapZeroCopy(SOCKET client, zerocopyStats *stats, int timeout);
+int drainZeroCopy(SOCKET client, zerocopyStats *stats);
+int parseEngine(const char *name, clientEngine *engine);
+int runEpollEngine(connectionPool *pool, payloadSource *source, engineStats *stats);
+int runUringEngine(connectionPool *pool, payloadSource *source, engineStats *stats);
+int receiveLine(transport *client, char *line, size_t capacity, int timeout);
+char* receiveMessage(transport *client);
+int querySize(transport *client, int *width, int *height);
+int probeServer(transport *client, serverCapabilities *capabilities);
 
 #endif
\ No newline at end of file
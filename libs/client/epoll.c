@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../log/log.h"
+#include "client.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#define MAX_EPOLL_EVENTS 64
+
+/**
+ * Structure to represent the write cursor of one non-blocking connection.
+ */
+typedef struct {
+    const char *data;
+    size_t length;
+    size_t cursor; // Number of bytes of data already written
+    int flags;     // Original file status flags, restored when the engine stops
+    int active;
+} writeCursor;
+
+/**
+ * Write to a connection until its payloads run out or the socket would block.
+ * @param pool Pool the connection belongs to.
+ * @param index Index of the connection.
+ * @param cursor Write cursor of the connection.
+ * @param source Source of the payloads.
+ * @param stats Stats to account the writes to.
+ * @return 1 while the connection has more to send, 0 once it is done or failed.
+ */
+static int drainConnection(connectionPool *pool, int index, writeCursor *cursor, payloadSource *source, engineStats *stats) {
+    for (;;) {
+        if (cursor->cursor == cursor->length) {
+            cursor->cursor = cursor->length = 0;
+            if (!source->next(index, &cursor->data, &cursor->length, source->context)) {
+                return 0;
+            }
+            continue;
+        }
+
+        ssize_t res = send(
+            pool->connections[index].socket,
+            cursor->data + cursor->cursor,
+            cursor->length - cursor->cursor,
+            MSG_NOSIGNAL
+        );
+        stats->syscalls++;
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1; // Wait for EPOLLOUT
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("[!] send() failed on connection %d: %s\n", index, strerror(errno));
+            return 0;
+        }
+        cursor->cursor += res;
+        stats->bytes += res;
+    }
+}
+
+/**
+ * Drive every connection of a pool from a single edge-triggered epoll loop.
+ *
+ * Each connection is switched to non-blocking mode and keeps its own write cursor into the payload
+ * it is currently sending. Whenever a connection becomes writable it is written to until the socket
+ * would block, fetching its next payload from the source as soon as the current one is done.
+ * The engine returns once the source has no payload left for any connection.
+ *
+ * @param pool Connections to send on.
+ * @param source Source of the payloads.
+ * @param stats Receives the work done by the engine.
+ * @return 0 on success, -1 if the event loop could not be set up or failed.
+ */
+int runEpollEngine(connectionPool *pool, payloadSource *source, engineStats *stats) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int active = 0, err = 0;
+    int i;
+
+    ZeroMemory(stats, sizeof(*stats));
+    writeCursor *cursors = (writeCursor*)calloc(pool->count, sizeof(writeCursor));
+    if (cursors == NULL) {
+        log_error("[!] Unable to allocate write cursors for %d connections\n", pool->count);
+        return -1;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        log_error("[!] epoll_create1() failed: %s\n", strerror(errno));
+        free(cursors);
+        return -1;
+    }
+
+    for (i = 0; i < pool->count; i++) {
+        SOCKET connection = pool->connections[i].socket;
+        struct epoll_event event = { .events = EPOLLOUT | EPOLLET, .data.u32 = i };
+
+        cursors[i].flags = fcntl(connection, F_GETFL);
+        if (cursors[i].flags < 0 || fcntl(connection, F_SETFL, cursors[i].flags | O_NONBLOCK) < 0) {
+            log_error("[!] Unable to make connection %d non-blocking: %s\n", i, strerror(errno));
+            continue;
+        }
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, connection, &event) < 0) {
+            log_error("[!] Unable to watch connection %d: %s\n", i, strerror(errno));
+            fcntl(connection, F_SETFL, cursors[i].flags);
+            cursors[i].flags = -1;
+            continue;
+        }
+        cursors[i].active = 1;
+        active++;
+    }
+
+    while (active > 0) {
+        int n = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("[!] epoll_wait() failed: %s\n", strerror(errno));
+            err = -1;
+            break;
+        }
+        stats->wakeups++;
+
+        for (i = 0; i < n; i++) {
+            int index = events[i].data.u32;
+            writeCursor *cursor = &cursors[index];
+            if (!cursor->active) {
+                continue;
+            }
+
+            int pending;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                log_error("[!] Connection %d was closed by the server\n", index);
+                pending = 0;
+            } else {
+                pending = drainConnection(pool, index, cursor, source, stats);
+            }
+
+            if (!pending) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, pool->connections[index].socket, NULL);
+                cursor->active = 0;
+                active--;
+            }
+        }
+    }
+
+    // Hand the connections back in blocking mode
+    for (i = 0; i < pool->count; i++) {
+        if (cursors[i].flags >= 0) {
+            fcntl(pool->connections[i].socket, F_SETFL, cursors[i].flags);
+        }
+    }
+    close(epfd);
+    free(cursors);
+
+    log_info("[*] epoll engine: sent %llu bytes in %llu send() calls over %llu wakeups\n",
+             stats->bytes, stats->syscalls, stats->wakeups);
+    return err;
+}
+
+#else
+
+int runEpollEngine(connectionPool *pool, payloadSource *source, engineStats *stats) {
+    (void)pool;
+    (void)source;
+    (void)stats;
+    log_error("[!] The epoll engine is only available on Linux\n");
+    return -1;
+}
+
+#endif
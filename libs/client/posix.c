@@ -0,0 +1,95 @@
+#ifndef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include "../log/log.h"
+#include "transport.h"
+
+static int posixConnect(transport *transport, const char *host, const char *port) {
+    transport->socket = openSocket(host, port, SOCK_STREAM, &transport->options, &transport->bindFailed);
+    return transport->socket == INVALID_SOCKET ? -1 : 0;
+}
+
+static long long posixWrite(transport *transport, const char *data, size_t length) {
+    ssize_t res;
+    do {
+        res = send(transport->socket, data, length, MSG_NOSIGNAL);
+    } while (res < 0 && errno == EINTR);
+
+    transport->stats.writes++;
+    if (res < 0) {
+        return SOCKET_ERROR;
+    }
+    transport->stats.bytesWritten += res;
+    return res;
+}
+
+static long long posixWritev(transport *transport, const ioSlice *slices, int count) {
+    struct iovec iov[MAX_IO_SLICES];
+    struct msghdr msg;
+    ssize_t res;
+    int i;
+
+    if (count > MAX_IO_SLICES) {
+        count = MAX_IO_SLICES;
+    }
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = (void*)slices[i].data;
+        iov[i].iov_len = slices[i].length;
+    }
+    ZeroMemory(&msg, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    // sendmsg() instead of writev() so a closed connection cannot raise SIGPIPE
+    do {
+        res = sendmsg(transport->socket, &msg, MSG_NOSIGNAL);
+    } while (res < 0 && errno == EINTR);
+
+    transport->stats.writes++;
+    if (res < 0) {
+        return SOCKET_ERROR;
+    }
+    transport->stats.bytesWritten += res;
+    return res;
+}
+
+static long long posixRead(transport *transport, char *buffer, size_t length) {
+    ssize_t res;
+    do {
+        res = recv(transport->socket, buffer, length, 0);
+    } while (res < 0 && errno == EINTR);
+
+    transport->stats.reads++;
+    if (res < 0) {
+        return SOCKET_ERROR;
+    }
+    transport->stats.bytesRead += res;
+    return res;
+}
+
+static void posixClose(transport *transport) {
+    if (transport->socket != INVALID_SOCKET) {
+        close(transport->socket);
+        transport->socket = INVALID_SOCKET;
+    }
+}
+
+/**
+ * Transport backend on top of POSIX TCP sockets.
+ */
+const transportOps posixTransport = {
+    .name = "posix",
+    .connect = posixConnect,
+    .write = posixWrite,
+    .writev = posixWritev,
+    .read = posixRead,
+    .close = posixClose,
+    .stats = copyTransportStats,
+};
+
+#endif
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../log/log.h"
+#include "transport.h"
+
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#endif
+
+/**
+ * Get the transport backend of the platform.
+ * @return The Winsock backend on Windows, the POSIX backend everywhere else.
+ */
+const transportOps* defaultTransport() {
+#ifdef _WIN32
+    return &winsockTransport;
+#else
+    return &posixTransport;
+#endif
+}
+
+/**
+ * Apply the configured socket options to a socket.
+ * Options that cannot be set are logged and skipped, the connection stays usable without them.
+ * @param socket Socket to configure.
+ * @param options Options to apply.
+ */
+void applyTransportOptions(SOCKET socket, const transportOptions *options) {
+    if (options->noDelay) {
+        int one = 1;
+        if (setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one)) != 0) {
+            log_warn("[!] Unable to set TCP_NODELAY: %ld\n", WSAGetLastError());
+        }
+    }
+    if (options->cork) {
+#ifdef TCP_CORK
+        int one = 1;
+        if (setsockopt(socket, IPPROTO_TCP, TCP_CORK, (const char*)&one, sizeof(one)) != 0) {
+            log_warn("[!] Unable to set TCP_CORK: %ld\n", WSAGetLastError());
+        }
+#else
+        log_warn("[!] TCP_CORK is not supported on this platform\n");
+#endif
+    }
+    if (options->sendBuffer > 0) {
+        if (setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (const char*)&options->sendBuffer, sizeof(options->sendBuffer)) != 0) {
+            log_warn("[!] Unable to set SO_SNDBUF to %d: %ld\n", options->sendBuffer, WSAGetLastError());
+        }
+    }
+}
+
+/**
+ * Resolve a host to every IPv4 and IPv6 address it has.
+ * On Windows Winsock stays initialized until the addresses are released with freeAddresses.
+ * @param host Host to resolve.
+ * @param port Port to connect to.
+ * @param socktype SOCK_STREAM or SOCK_DGRAM.
+ * @param result Receives the list of addresses.
+ * @return 0 on success, -1 if the host could not be resolved.
+ */
+int resolveHost(const char *host, const char *port, int socktype, struct addrinfo **result) {
+    struct addrinfo hints;
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    hints.ai_protocol = socktype == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP;
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        log_fatal("[!] WSAStartup() failed\n");
+        return -1;
+    }
+#endif
+    int iResult = getaddrinfo(host, port, &hints, result);
+    if (iResult != 0) {
+        log_fatal("[!] getaddrinfo failed: %d\n", iResult);
+        WSACleanup();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Release the addresses returned by resolveHost.
+ * @param addresses The list of addresses.
+ */
+void freeAddresses(struct addrinfo *addresses) {
+    freeaddrinfo(addresses);
+    WSACleanup();
+}
+
+/**
+ * Format an address as a numeric host, for logging.
+ * @param address The address.
+ * @param length Size of the address.
+ * @param out Receives the host, at least NI_MAXHOST bytes.
+ * @param size Size of out.
+ */
+void formatAddress(const struct sockaddr *address, size_t length, char *out, size_t size) {
+    if (getnameinfo(address, (socklen_t)length, out, (socklen_t)size, NULL, 0, NI_NUMERICHOST) != 0) {
+        snprintf(out, size, "?");
+    }
+}
+
+/**
+ * Bind a socket to a local source address before it connects.
+ * @param socket Socket to bind.
+ * @param source Numeric local address, of the same family as the socket.
+ * @param target The address the socket will connect to.
+ * @return 0 on success, -1 on failure.
+ */
+static int bindSource(SOCKET socket, const char *source, const struct addrinfo *target) {
+    struct addrinfo *local = NULL, hints;
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family   = target->ai_family;
+    hints.ai_socktype = target->ai_socktype;
+    hints.ai_flags    = AI_NUMERICHOST | AI_PASSIVE;
+
+    if (getaddrinfo(source, NULL, &hints, &local) != 0) {
+        log_error("[!] Invalid source address for this target: %s\n", source);
+        return -1;
+    }
+    int res = bind(socket, local->ai_addr, (int)local->ai_addrlen);
+    freeaddrinfo(local);
+    if (res == SOCKET_ERROR) {
+        log_error("[!] Unable to bind to %s: %ld\n", source, WSAGetLastError());
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Open a socket connected to one address, with the given options applied.
+ * @param address Address to connect to.
+ * @param options Socket options to apply, and the source address to bind to if any.
+ * @param bindFailed Set to 1 if the socket could not be bound to the source, 0 otherwise.
+ * @return The connected socket, or INVALID_SOCKET on failure.
+ */
+static SOCKET connectAddress(const struct addrinfo *address, const transportOptions *options, int *bindFailed) {
+    *bindFailed = 0;
+    SOCKET clientSocket = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (clientSocket == INVALID_SOCKET) {
+        log_error("[!] Error at socket(): %ld\n", WSAGetLastError());
+        return INVALID_SOCKET;
+    }
+    applyTransportOptions(clientSocket, options);
+
+    *bindFailed = options->source != NULL && bindSource(clientSocket, options->source, address) != 0;
+    if (*bindFailed || connect(clientSocket, address->ai_addr, (int)address->ai_addrlen) == SOCKET_ERROR) {
+        closesocket(clientSocket);
+        return INVALID_SOCKET;
+    }
+    return clientSocket;
+}
+
+/**
+ * Open a connected socket with the given options applied.
+ * Connects to `options->target` if set, otherwise resolves the host and connects to the first
+ * of its addresses that accepts the connection.
+ * @param host Host to connect to.
+ * @param port Port to connect to.
+ * @param socktype SOCK_STREAM or SOCK_DGRAM.
+ * @param options Socket options to apply before connecting.
+ * @param bindFailed Set to 1 if the last attempt failed on binding to the source rather than on connecting.
+ * @return The connected socket, or INVALID_SOCKET on failure.
+ */
+SOCKET openSocket(const char *host, const char *port, int socktype, const transportOptions *options, int *bindFailed) {
+    SOCKET clientSocket = INVALID_SOCKET;
+    *bindFailed = 0;
+    if (options->target != NULL) {
+        clientSocket = connectAddress(options->target, options, bindFailed);
+    } else {
+        struct addrinfo *result = NULL, *ptr;
+        if (resolveHost(host, port, socktype, &result) != 0) {
+            return INVALID_SOCKET;
+        }
+        for (ptr = result; ptr != NULL && clientSocket == INVALID_SOCKET; ptr = ptr->ai_next) {
+            clientSocket = connectAddress(ptr, options, bindFailed);
+        }
+        freeAddresses(result);
+    }
+
+    // Failing to reach a given target is up to the caller, who may try another one
+    if (clientSocket == INVALID_SOCKET && options->target == NULL) {
+        log_fatal("[!] Unable to connect to server!\n");
+    }
+    return clientSocket;
+}
+
+/**
+ * Wait until a socket has data to read.
+ * @param socket Socket to wait on.
+ * @param timeout Milliseconds to wait for at most, a negative value waits forever.
+ * @return 1 once the socket is readable, 0 on timeout, or SOCKET_ERROR on failure.
+ */
+int waitReadable(SOCKET socket, int timeout) {
+    fd_set readable;
+    struct timeval tv, *wait = NULL;
+
+    if (timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        wait = &tv;
+    }
+    FD_ZERO(&readable);
+    FD_SET(socket, &readable);
+    // The first argument is ignored by Winsock
+    int res = select((int)socket + 1, &readable, NULL, NULL, wait);
+    if (res < 0) {
+        return SOCKET_ERROR;
+    }
+    return res > 0;
+}
+
+/**
+ * Generic `stats` operation for backends that only count in `transport->stats`.
+ * @param transport The transport to read.
+ * @param stats Receives a copy of its stats.
+ */
+void copyTransportStats(transport *transport, transportStats *stats) {
+    *stats = transport->stats;
+}
@@ -0,0 +1,114 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Mswsock.lib")
+#pragma comment(lib, "AdvApi32.lib")
+
+#define MSG_NOSIGNAL 0
+#else
+// Map the Winsock names used throughout the client onto POSIX sockets.
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket(s) close(s)
+#define ZeroMemory(dest, length) memset((dest), 0, (length))
+#define WSAGetLastError() ((long)errno)
+#define WSACleanup() ((void)0)
+#endif
+
+#define MAX_IO_SLICES 64 // Slices handed to a single writev, datagrams handed to a single sendmmsg
+#define UDP_DEFAULT_MTU 1500 // Assumed when the path MTU of a UDP socket is unknown
+
+/**
+ * Structure to represent one piece of a gather write, like `struct iovec` but portable.
+ */
+typedef struct {
+    const char *data;
+    size_t length;
+} ioSlice;
+
+/**
+ * Structure to represent the socket options a transport applies when it connects.
+ */
+typedef struct {
+    int noDelay;    // Set TCP_NODELAY to send small writes immediately
+    int cork;       // Set TCP_CORK to only send full segments (Linux only)
+    int sendBuffer; // SO_SNDBUF in bytes, 0 keeps the system default
+    int udp;        // Send datagrams with the UDP transport instead of a TCP stream (not on Windows)
+    const struct addrinfo *target; // Resolved address to connect to, NULL to resolve the host
+    const char *source;            // Numeric local address to bind to, NULL for any
+} transportOptions;
+
+/**
+ * Structure to represent the I/O done by a transport.
+ */
+typedef struct {
+    unsigned long long bytesWritten;
+    unsigned long long bytesRead;
+    unsigned long long writes; // write/writev syscalls
+    unsigned long long reads;  // read syscalls
+    unsigned long long datagrams; // Datagrams sent, UDP only
+} transportStats;
+
+typedef struct transport transport;
+
+/**
+ * Table of the operations a transport backend implements.
+ * write, writev and read map to a single syscall and may transfer fewer bytes than asked for.
+ * They return the number of bytes transferred, 0 when the peer closed the connection
+ * (read only), or SOCKET_ERROR on failure.
+ */
+typedef struct {
+    const char *name;
+    int (*connect)(transport *transport, const char *host, const char *port);
+    long long (*write)(transport *transport, const char *data, size_t length);
+    long long (*writev)(transport *transport, const ioSlice *slices, int count);
+    long long (*read)(transport *transport, char *buffer, size_t length);
+    void (*close)(transport *transport);
+    void (*stats)(transport *transport, transportStats *stats);
+} transportOps;
+
+/**
+ * Structure to represent one connection through a transport backend.
+ */
+struct transport {
+    const transportOps *ops;
+    SOCKET socket;
+    transportOptions options;
+    transportStats stats;
+    size_t datagramSize; // Largest datagram payload, UDP only
+    size_t recordSize;   // Size of fixed-size commands like PB, 0 for lines; datagrams never split a command
+    int bindFailed;      // Set when connecting failed on binding to options.source rather than on the target
+};
+
+const transportOps* defaultTransport();
+int resolveHost(const char *host, const char *port, int socktype, struct addrinfo **result);
+void freeAddresses(struct addrinfo *addresses);
+void formatAddress(const struct sockaddr *address, size_t length, char *out, size_t size);
+SOCKET openSocket(const char *host, const char *port, int socktype, const transportOptions *options, int *bindFailed);
+void applyTransportOptions(SOCKET socket, const transportOptions *options);
+int waitReadable(SOCKET socket, int timeout);
+void copyTransportStats(transport *transport, transportStats *stats);
+
+#ifdef _WIN32
+extern const transportOps winsockTransport;
+#else
+extern const transportOps posixTransport;
+extern const transportOps udpTransport;
+#endif
+
+#endif
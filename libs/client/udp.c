@@ -0,0 +1,221 @@
+#ifndef _WIN32
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sendmmsg
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "../log/log.h"
+#include "transport.h"
+
+#ifdef __linux__
+typedef struct mmsghdr udpMessage;
+#else
+// Mirrors the Linux structure, without sendmmsg only the first datagram is sent
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} udpMessage;
+#endif
+
+/**
+ * Find the largest datagram payload that fits in the path MTU of a connected UDP socket.
+ * @param socket The connected socket.
+ * @return The payload size in bytes.
+ */
+static size_t datagramSize(SOCKET socket) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    ZeroMemory(&address, sizeof(address));
+    int overhead = 20 + 8; // IPv4 and UDP headers
+    if (getsockname(socket, (struct sockaddr*)&address, &length) == 0 && address.ss_family == AF_INET6) {
+        overhead = 40 + 8;
+    }
+
+    int mtu = UDP_DEFAULT_MTU;
+#ifdef IP_MTU
+    // Only known once connected, and only on Linux
+    int pathMtu;
+    socklen_t size = sizeof(pathMtu);
+    int level = address.ss_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+    int option = address.ss_family == AF_INET6 ? IPV6_MTU : IP_MTU;
+    if (getsockopt(socket, level, option, &pathMtu, &size) == 0 && pathMtu > overhead) {
+        mtu = pathMtu;
+    }
+#endif
+    return (size_t)(mtu - overhead);
+}
+
+static int udpConnect(transport *transport, const char *host, const char *port) {
+    // Stream options make no sense for datagrams
+    transportOptions options = transport->options;
+    options.noDelay = options.cork = 0;
+    transport->socket = openSocket(host, port, SOCK_DGRAM, &options, &transport->bindFailed);
+    if (transport->socket == INVALID_SOCKET) {
+        return -1;
+    }
+    transport->datagramSize = datagramSize(transport->socket);
+    log_debug("[*] UDP datagrams carry up to %zu bytes\n", transport->datagramSize);
+    return 0;
+}
+
+/**
+ * Find how much of some data fits in the room left in a datagram without splitting a command.
+ * Lines are cut after their newline, fixed-size records after a whole number of records.
+ * @param transport The transport, whose recordSize applies.
+ * @param data Data to send.
+ * @param length Bytes left to send.
+ * @param room Bytes left in the datagram.
+ * @return Number of bytes that fit, 0 if not even one command does.
+ */
+static size_t packDatagram(transport *transport, const char *data, size_t length, size_t room) {
+    if (length <= room) {
+        return length;
+    }
+    if (transport->recordSize > 0) {
+        return room / transport->recordSize * transport->recordSize;
+    }
+    const char *end = data + room;
+    while (end > data && end[-1] != '\n') {
+        end--;
+    }
+    return end - data;
+}
+
+/**
+ * Find the length of the first command of some data, for commands too long for any datagram.
+ */
+static size_t firstCommand(transport *transport, const char *data, size_t length) {
+    if (transport->recordSize > 0) {
+        return transport->recordSize < length ? transport->recordSize : length;
+    }
+    const char *newline = memchr(data, '\n', length);
+    return newline != NULL ? (size_t)(newline - data) + 1 : length;
+}
+
+/**
+ * Send slices as datagrams packed with whole commands.
+ * A datagram gathers pieces of consecutive slices, so small slices share datagrams without being copied.
+ * With sendmmsg up to MAX_IO_SLICES datagrams go out in a single syscall, elsewhere only the
+ * first datagram is sent. A short count always ends on a command boundary.
+ * @param transport The transport to send on.
+ * @param slices The data to send.
+ * @param count Number of slices.
+ * @return Number of bytes sent, or SOCKET_ERROR on failure.
+ */
+static long long sendDatagrams(transport *transport, const ioSlice *slices, int count) {
+    udpMessage messages[MAX_IO_SLICES];
+    struct iovec iov[MAX_IO_SLICES];
+    int datagrams = 0, pieces = 0, i;
+    size_t room = 0;
+
+    ZeroMemory(messages, sizeof(messages));
+    for (i = 0; i < count && pieces < MAX_IO_SLICES; i++) {
+        size_t done = 0;
+        while (done < slices[i].length && pieces < MAX_IO_SLICES) {
+            const char *data = slices[i].data + done;
+            size_t size = packDatagram(transport, data, slices[i].length - done, room);
+            if (size == 0) {
+                // Nothing fits in the current datagram, start the next one
+                if (datagrams == MAX_IO_SLICES) {
+                    break;
+                }
+                messages[datagrams].msg_hdr.msg_iov = &iov[pieces];
+                datagrams++;
+                room = transport->datagramSize;
+                size = packDatagram(transport, data, slices[i].length - done, room);
+                if (size == 0) {
+                    size = firstCommand(transport, data, slices[i].length - done);
+                }
+            }
+            iov[pieces].iov_base = (void*)data;
+            iov[pieces].iov_len = size;
+            pieces++;
+            messages[datagrams - 1].msg_hdr.msg_iovlen++;
+            room = size < room ? room - size : 0;
+            done += size;
+        }
+        if (done < slices[i].length) {
+            break;
+        }
+    }
+
+#ifdef __linux__
+    int res;
+    do {
+        res = sendmmsg(transport->socket, messages, datagrams, MSG_NOSIGNAL);
+    } while (res < 0 && errno == EINTR);
+    transport->stats.writes++;
+    if (res < 0) {
+        return SOCKET_ERROR;
+    }
+    long long sent = 0;
+    for (i = 0; i < res; i++) {
+        sent += messages[i].msg_len;
+    }
+    transport->stats.datagrams += res;
+#else
+    ssize_t sent;
+    do {
+        sent = sendmsg(transport->socket, &messages[0].msg_hdr, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    transport->stats.writes++;
+    if (sent < 0) {
+        return SOCKET_ERROR;
+    }
+    transport->stats.datagrams++;
+#endif
+    transport->stats.bytesWritten += sent;
+    return sent;
+}
+
+static long long udpWrite(transport *transport, const char *data, size_t length) {
+    ioSlice slice = { data, length };
+    return sendDatagrams(transport, &slice, 1);
+}
+
+static long long udpWritev(transport *transport, const ioSlice *slices, int count) {
+    return sendDatagrams(transport, slices, count > MAX_IO_SLICES ? MAX_IO_SLICES : count);
+}
+
+static long long udpRead(transport *transport, char *buffer, size_t length) {
+    ssize_t res;
+    do {
+        res = recv(transport->socket, buffer, length, 0);
+    } while (res < 0 && errno == EINTR);
+
+    transport->stats.reads++;
+    if (res < 0) {
+        return SOCKET_ERROR;
+    }
+    transport->stats.bytesRead += res;
+    return res;
+}
+
+static void udpClose(transport *transport) {
+    if (transport->socket != INVALID_SOCKET) {
+        close(transport->socket);
+        transport->socket = INVALID_SOCKET;
+    }
+}
+
+/**
+ * Transport backend sending pixelflut commands as UDP datagrams.
+ * Datagrams are packed with whole commands up to the path MTU. Lost datagrams are not
+ * resent, which pixelflut tolerates since the next pass paints the pixels again.
+ */
+const transportOps udpTransport = {
+    .name = "udp",
+    .connect = udpConnect,
+    .write = udpWrite,
+    .writev = udpWritev,
+    .read = udpRead,
+    .close = udpClose,
+    .stats = copyTransportStats,
+};
+
+#endif
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../log/log.h"
+#include "client.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define MIN_URING_ENTRIES 8
+#define MAX_URING_ENTRIES 4096
+
+/**
+ * Structure to represent an io_uring instance and its mapped rings.
+ */
+typedef struct {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+    unsigned entries;
+} uring;
+
+/**
+ * Structure to represent the write cursor of one connection driven by the ring.
+ */
+typedef struct {
+    const char *data;
+    size_t length;
+    size_t cursor; // Number of bytes of data already written
+    int active;
+} uringCursor;
+
+static int uringSetup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/**
+ * Release an io_uring instance and unmap its rings.
+ * @param ring The ring to close.
+ */
+static void closeUring(uring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+}
+
+/**
+ * Create an io_uring instance and map its submission and completion rings.
+ * @param ring The ring to initialize.
+ * @param entries Minimum number of submission queue entries.
+ * @return 0 on success, -1 on failure.
+ */
+static int initUring(uring *ring, unsigned entries) {
+    struct io_uring_params params;
+
+    ZeroMemory(ring, sizeof(*ring));
+    ZeroMemory(&params, sizeof(params));
+    ring->fd = uringSetup(entries, &params);
+    if (ring->fd < 0) {
+        log_error("[!] io_uring_setup() failed: %s\n", strerror(errno));
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        goto err;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            goto err;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto err;
+    }
+
+    ring->sqHead = (unsigned*)((char*)ring->sqRing + params.sq_off.head);
+    ring->sqTail = (unsigned*)((char*)ring->sqRing + params.sq_off.tail);
+    ring->sqMask = (unsigned*)((char*)ring->sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)((char*)ring->sqRing + params.sq_off.array);
+    ring->cqHead = (unsigned*)((char*)ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned*)((char*)ring->cqRing + params.cq_off.tail);
+    ring->cqMask = (unsigned*)((char*)ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cqRing + params.cq_off.cqes);
+    return 0;
+
+ err:
+    log_error("[!] Unable to map io_uring rings: %s\n", strerror(errno));
+    closeUring(ring);
+    return -1;
+}
+
+/**
+ * Queue the next write of a connection, fetching a new payload once the current one is done.
+ * @param ring The ring to queue into.
+ * @param index Index of the connection, which is also its registered file index.
+ * @param cursor Write cursor of the connection.
+ * @param source Source of the payloads.
+ * @param fixedBuffers Set if the source's memory is registered with the ring.
+ * @return 1 if a write was queued, 0 once the connection has nothing left to send.
+ */
+static int queueWrite(uring *ring, int index, uringCursor *cursor, payloadSource *source, int fixedBuffers) {
+    while (cursor->cursor == cursor->length) {
+        cursor->cursor = cursor->length = 0;
+        if (!source->next(index, &cursor->data, &cursor->length, source->context)) {
+            return 0;
+        }
+    }
+
+    const char *data = cursor->data + cursor->cursor;
+    size_t length = cursor->length - cursor->cursor;
+    if (length > INT_MAX) {
+        length = INT_MAX;
+    }
+
+    unsigned tail = *ring->sqTail;
+    unsigned slot = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    ZeroMemory(sqe, sizeof(*sqe));
+    sqe->fd = index;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long long)(uintptr_t)data;
+    sqe->len = (unsigned)length;
+    sqe->user_data = index;
+    if (fixedBuffers && data >= source->base && data + length <= source->base + source->size) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = 0;
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    ring->sqArray[slot] = slot;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Drive every connection of a pool through an io_uring instance.
+ *
+ * The sockets are registered as fixed files and the payload memory of the source as a fixed
+ * buffer, so the kernel does not have to look either of them up per write. Every connection
+ * keeps exactly one write in flight to preserve the order of its stream, and the writes of all
+ * connections are submitted and reaped in batches with a single io_uring_enter() call per round.
+ * If the buffer cannot be registered (e.g. because of RLIMIT_MEMLOCK) plain sends are used instead.
+ *
+ * @param pool Connections to send on.
+ * @param source Source of the payloads.
+ * @param stats Receives the work done by the engine.
+ * @return 0 on success, -1 if the ring could not be set up or failed.
+ */
+int runUringEngine(connectionPool *pool, payloadSource *source, engineStats *stats) {
+    uring ring;
+    unsigned entries = MIN_URING_ENTRIES;
+    int active = 0, queued = 0, err = 0;
+    int fixedBuffers = 0;
+    int i;
+
+    ZeroMemory(stats, sizeof(*stats));
+    while (entries < (unsigned)pool->count && entries < MAX_URING_ENTRIES) {
+        entries <<= 1;
+    }
+    if ((unsigned)pool->count > entries) {
+        log_error("[!] io_uring engine supports at most %d connections\n", MAX_URING_ENTRIES);
+        return -1;
+    }
+
+    uringCursor *cursors = (uringCursor*)calloc(pool->count, sizeof(uringCursor));
+    if (cursors == NULL) {
+        log_error("[!] Unable to allocate write cursors for %d connections\n", pool->count);
+        return -1;
+    }
+    if (initUring(&ring, entries) != 0) {
+        free(cursors);
+        return -1;
+    }
+
+    int *files = (int*)malloc(pool->count * sizeof(int));
+    if (files == NULL) {
+        log_error("[!] Unable to allocate file table for %d connections\n", pool->count);
+        closeUring(&ring);
+        free(cursors);
+        return -1;
+    }
+    for (i = 0; i < pool->count; i++) {
+        files[i] = pool->connections[i].socket;
+    }
+    int registered = uringRegister(ring.fd, IORING_REGISTER_FILES, files, pool->count);
+    free(files);
+    if (registered < 0) {
+        log_error("[!] Unable to register connections with io_uring: %s\n", strerror(errno));
+        closeUring(&ring);
+        free(cursors);
+        return -1;
+    }
+    if (source->base != NULL && source->size > 0) {
+        struct iovec buffer = { .iov_base = (void*)source->base, .iov_len = source->size };
+        if (uringRegister(ring.fd, IORING_REGISTER_BUFFERS, &buffer, 1) == 0) {
+            fixedBuffers = 1;
+        } else {
+            log_warn("[!] Unable to register %zu byte buffer with io_uring (%s), using plain sends\n",
+                     source->size, strerror(errno));
+        }
+    }
+
+    for (i = 0; i < pool->count; i++) {
+        cursors[i].active = queueWrite(&ring, i, &cursors[i], source, fixedBuffers);
+        active += cursors[i].active;
+        queued += cursors[i].active;
+    }
+
+    while (active > 0) {
+        int res = uringEnter(ring.fd, queued, 1, IORING_ENTER_GETEVENTS);
+        stats->syscalls++;
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("[!] io_uring_enter() failed: %s\n", strerror(errno));
+            err = -1;
+            break;
+        }
+        queued -= res;
+        stats->wakeups++;
+
+        // Reap every completion, then queue the follow-up writes for the next round
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            int index = (int)cqe->user_data;
+            uringCursor *cursor = &cursors[index];
+
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+                // Retry the same bytes
+            } else if (cqe->res <= 0) {
+                log_error("[!] Write failed on connection %d: %s\n", index,
+                          cqe->res == 0 ? "connection closed" : strerror(-cqe->res));
+                cursor->active = 0;
+                active--;
+                continue;
+            } else {
+                cursor->cursor += cqe->res;
+                stats->bytes += cqe->res;
+            }
+
+            if (!queueWrite(&ring, index, cursor, source, fixedBuffers)) {
+                cursor->active = 0;
+                active--;
+            } else {
+                queued++;
+            }
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    closeUring(&ring);
+    free(cursors);
+
+    log_info("[*] io_uring engine: sent %llu bytes in %llu io_uring_enter() calls (%s buffers)\n",
+             stats->bytes, stats->syscalls, fixedBuffers ? "registered" : "unregistered");
+    return err;
+}
+
+#else
+
+int runUringEngine(connectionPool *pool, payloadSource *source, engineStats *stats) {
+    (void)pool;
+    (void)source;
+    (void)stats;
+    log_error("[!] The io_uring engine is only available on Linux\n");
+    return -1;
+}
+
+#endif
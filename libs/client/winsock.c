@@ -0,0 +1,89 @@
+#ifdef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "../log/log.h"
+#include "transport.h"
+
+static int winsockConnect(transport *transport, const char *host, const char *port) {
+    WSADATA wsaData;
+    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (iResult != 0) {
+        log_error("WSAStartup() failed: %d\n", iResult);
+        return -1;
+    }
+
+    transport->socket = openSocket(host, port, SOCK_STREAM, &transport->options, &transport->bindFailed);
+    if (transport->socket == INVALID_SOCKET) {
+        WSACleanup();
+        return -1;
+    }
+    return 0;
+}
+
+static long long winsockWrite(transport *transport, const char *data, size_t length) {
+    int res = send(transport->socket, data, length > INT_MAX ? INT_MAX : (int)length, 0);
+    transport->stats.writes++;
+    if (res == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+    transport->stats.bytesWritten += res;
+    return res;
+}
+
+static long long winsockWritev(transport *transport, const ioSlice *slices, int count) {
+    WSABUF buffers[MAX_IO_SLICES];
+    DWORD sent = 0;
+    int i;
+
+    if (count > MAX_IO_SLICES) {
+        count = MAX_IO_SLICES;
+    }
+    for (i = 0; i < count; i++) {
+        buffers[i].buf = (char*)slices[i].data;
+        buffers[i].len = (ULONG)slices[i].length;
+    }
+
+    int res = WSASend(transport->socket, buffers, count, &sent, 0, NULL, NULL);
+    transport->stats.writes++;
+    if (res == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+    transport->stats.bytesWritten += sent;
+    return sent;
+}
+
+static long long winsockRead(transport *transport, char *buffer, size_t length) {
+    int res = recv(transport->socket, buffer, length > INT_MAX ? INT_MAX : (int)length, 0);
+    transport->stats.reads++;
+    if (res == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+    transport->stats.bytesRead += res;
+    return res;
+}
+
+static void winsockClose(transport *transport) {
+    if (transport->socket != INVALID_SOCKET) {
+        closesocket(transport->socket);
+        transport->socket = INVALID_SOCKET;
+        WSACleanup(); // Balances the WSAStartup() done by winsockConnect()
+    }
+}
+
+/**
+ * Transport backend on top of Winsock TCP sockets.
+ */
+const transportOps winsockTransport = {
+    .name = "winsock",
+    .connect = winsockConnect,
+    .write = winsockWrite,
+    .writev = winsockWritev,
+    .read = winsockRead,
+    .close = winsockClose,
+    .stats = copyTransportStats,
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "../log/log.h"
+#include "client.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#define ZEROCOPY_DRAIN_TIMEOUT 1000 // Milliseconds to wait for outstanding completions
+
+/**
+ * Enable MSG_ZEROCOPY sends on a connection.
+ * @param client Socket to enable zero-copy sends on.
+ * @return 0 on success, -1 if the kernel does not support it.
+ */
+int enableZeroCopy(SOCKET client) {
+    int one = 1;
+    if (setsockopt(client, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        log_warn("[!] SO_ZEROCOPY is not supported: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read the zero-copy completion notifications waiting on a connection's error queue.
+ * Every notification covers a range of sends and tells whether the kernel had to copy them after all.
+ * @param client Socket to read notifications from.
+ * @param stats Stats to account the completions to.
+ * @param timeout Milliseconds to wait for a notification if none is queued, 0 to not wait.
+ * @return Number of sends completed by the reaped notifications, or -1 on failure.
+ */
+int reapZeroCopy(SOCKET client, zerocopyStats *stats, int timeout) {
+    int reaped = 0;
+
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        ZeroMemory(&msg, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(client, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("[!] Unable to read zero-copy completions: %s\n", strerror(errno));
+                return -1;
+            }
+            if (reaped > 0 || timeout == 0) {
+                return reaped;
+            }
+
+            // Nothing queued yet, wait for the error queue to become readable once
+            struct pollfd pfd = { .fd = client, .events = 0 };
+            if (poll(&pfd, 1, timeout) <= 0 || !(pfd.revents & POLLERR)) {
+                return reaped;
+            }
+            timeout = 0;
+            continue;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err *err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            // ee_info..ee_data is the inclusive range of completed send() calls
+            unsigned long long count = err->ee_data - err->ee_info + 1;
+            stats->completed += count;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                stats->copied += count;
+            } else {
+                stats->zerocopied += count;
+            }
+            reaped += (int)count;
+        }
+    }
+}
+
+/**
+ * Send a buffer with MSG_ZEROCOPY, retrying after short writes until every byte has been written.
+ * The kernel references the pages of the buffer instead of copying them, so the buffer must stay
+ * alive and unchanged until its completions have been reaped.
+ * @param client Socket to send on, with zero-copy sends enabled.
+ * @param buffer Bytes to send.
+ * @param length Number of bytes to send.
+ * @param stats Stats to account the zero-copy sends and their completions to.
+ * @param flush Stats to account the bytes and send() calls to.
+ * @return 0 on success, or SOCKET_ERROR on failure.
+ */
+int sendZeroCopy(SOCKET client, const char* buffer, size_t length, zerocopyStats *stats, flushStats *flush) {
+    size_t sent = 0;
+
+    while (sent < length) {
+        size_t remaining = length - sent;
+        ssize_t res = send(client, buffer + sent, remaining > INT_MAX ? INT_MAX : remaining, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        flush->syscalls++;
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS) {
+                // Too many notifications pending, make room by reaping some
+                if (reapZeroCopy(client, stats, ZEROCOPY_DRAIN_TIMEOUT) < 0) {
+                    return SOCKET_ERROR;
+                }
+                continue;
+            }
+            log_error("[!] send(MSG_ZEROCOPY) failed: %s\n", strerror(errno));
+            return SOCKET_ERROR;
+        }
+        stats->sends++;
+        sent += res;
+        flush->bytes += res;
+    }
+
+    reapZeroCopy(client, stats, 0);
+    return 0;
+}
+
+/**
+ * Wait until every zero-copy send of a connection has completed.
+ * @param client Socket the sends were made on.
+ * @param stats Stats of the connection.
+ * @return 0 once all sends completed, -1 if they did not complete in time.
+ */
+int drainZeroCopy(SOCKET client, zerocopyStats *stats) {
+    while (stats->completed < stats->sends) {
+        if (reapZeroCopy(client, stats, ZEROCOPY_DRAIN_TIMEOUT) <= 0) {
+            log_warn("[!] %llu zero-copy sends did not complete\n", stats->sends - stats->completed);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#else
+
+int enableZeroCopy(SOCKET client) {
+    (void)client;
+    log_warn("[!] Zero-copy sends are only available on Linux\n");
+    return -1;
+}
+
+int reapZeroCopy(SOCKET client, zerocopyStats *stats, int timeout) {
+    (void)client;
+    (void)stats;
+    (void)timeout;
+    return 0;
+}
+
+int sendZeroCopy(SOCKET client, const char* buffer, size_t length, zerocopyStats *stats, flushStats *flush) {
+    (void)client;
+    (void)buffer;
+    (void)length;
+    (void)stats;
+    (void)flush;
+    return SOCKET_ERROR;
+}
+
+int drainZeroCopy(SOCKET client, zerocopyStats *stats) {
+    (void)client;
+    (void)stats;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "encoder.h"
+#include "../log/log.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ENCODER_X86 1
+#include <immintrin.h>
+#endif
+
+// "00" to "ff" for every byte value
+static const char hexTable[256][2] = {
+#define HEX_ROW(h) \
+    {h, '0'}, {h, '1'}, {h, '2'}, {h, '3'}, {h, '4'}, {h, '5'}, {h, '6'}, {h, '7'}, \
+    {h, '8'}, {h, '9'}, {h, 'a'}, {h, 'b'}, {h, 'c'}, {h, 'd'}, {h, 'e'}, {h, 'f'}
+    HEX_ROW('0'), HEX_ROW('1'), HEX_ROW('2'), HEX_ROW('3'),
+    HEX_ROW('4'), HEX_ROW('5'), HEX_ROW('6'), HEX_ROW('7'),
+    HEX_ROW('8'), HEX_ROW('9'), HEX_ROW('a'), HEX_ROW('b'),
+    HEX_ROW('c'), HEX_ROW('d'), HEX_ROW('e'), HEX_ROW('f')
+#undef HEX_ROW
+};
+
+/**
+ * Convert colors to their `rrggbbaa` hex strings, 8 output bytes per color.
+ * Portable kernel used when no vector kernel is available.
+ */
+static void hexifyScalar(const color *in, char *out, int count) {
+    int i;
+    for (i = 0; i < count; i++, out += 8) {
+        memcpy(out, hexTable[in[i].r], 2);
+        memcpy(out + 2, hexTable[in[i].g], 2);
+        memcpy(out + 4, hexTable[in[i].b], 2);
+        memcpy(out + 6, hexTable[in[i].a], 2);
+    }
+}
+
+#ifdef ENCODER_X86
+/**
+ * SSE2 kernel, converts 4 colors (16 bytes) into 32 hex digits per iteration.
+ * Every nibble n becomes '0' + n, plus 'a' - '0' - 10 when n > 9.
+ */
+__attribute__((target("sse2")))
+static void hexifySSE2(const color *in, char *out, int count) {
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letters = _mm_set1_epi8('a' - '0' - 10);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4, out += 32) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+        __m128i lo = _mm_and_si128(bytes, mask);
+        hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letters));
+        lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letters));
+        _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    hexifyScalar(in + i, out, count - i);
+}
+
+/**
+ * AVX2 kernel, converts 8 colors (32 bytes) into 64 hex digits per iteration.
+ * The unpacks work per 128-bit lane, so the lanes are put back in order before storing.
+ */
+__attribute__((target("avx2")))
+static void hexifyAVX2(const color *in, char *out, int count) {
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i letters = _mm256_set1_epi8('a' - '0' - 10);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8, out += 64) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), mask);
+        __m256i lo = _mm256_and_si256(bytes, mask);
+        hi = _mm256_add_epi8(_mm256_add_epi8(hi, zero), _mm256_and_si256(_mm256_cmpgt_epi8(hi, nine), letters));
+        lo = _mm256_add_epi8(_mm256_add_epi8(lo, zero), _mm256_and_si256(_mm256_cmpgt_epi8(lo, nine), letters));
+        __m256i first = _mm256_unpacklo_epi8(hi, lo);
+        __m256i second = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i*)out, _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i*)(out + 32), _mm256_permute2x128_si256(first, second, 0x31));
+    }
+    hexifySSE2(in + i, out, count - i);
+}
+#endif
+
+/**
+ * Pick the fastest hex kernel the CPU supports.
+ * @param encoder The encoder to set the kernel of.
+ */
+static void selectKernel(pxEncoder *encoder) {
+    encoder->hexify = hexifyScalar;
+    encoder->kernel = "scalar";
+#ifdef ENCODER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        encoder->hexify = hexifyAVX2;
+        encoder->kernel = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        encoder->hexify = hexifySSE2;
+        encoder->kernel = "sse2";
+    }
+#endif
+}
+
+/**
+ * Precompute the decimal strings of every coordinate from 0 up to maxCoordinate.
+ * @param encoder The encoder to initialize.
+ * @param maxCoordinate Largest x or y coordinate that will be encoded.
+ * @param options How pixels are encoded.
+ * @return 0 on success, -1 if the coordinate is out of range or memory could not be allocated.
+ */
+int initEncoder(pxEncoder *encoder, int maxCoordinate, const encoderOptions *options) {
+    memset(encoder, 0, sizeof(*encoder));
+    encoder->options = *options;
+    if (maxCoordinate < 0 || maxCoordinate > MAX_COORDINATE) {
+        log_error("[-] Coordinate %d is out of range for the encoder\n", maxCoordinate);
+        return -1;
+    }
+
+    int count = maxCoordinate + 1;
+    encoder->coordinates = malloc(count * sizeof(*encoder->coordinates));
+    encoder->lengths = (unsigned char*)malloc(count * sizeof(unsigned char));
+    if (encoder->coordinates == NULL || encoder->lengths == NULL) {
+        log_error("[-] Unable to allocate memory for the encoder tables\n");
+        freeEncoder(encoder);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < count; i++) {
+        char *slot = encoder->coordinates[i];
+        memset(slot, 0, COORDINATE_SLOT);
+        encoder->lengths[i] = (unsigned char)snprintf(slot, COORDINATE_SLOT, "%d ", i);
+    }
+    encoder->count = count;
+    selectKernel(encoder);
+    log_debug("[*] Encoder uses the %s hex kernel\n", encoder->kernel);
+    return 0;
+}
+
+/**
+ * Release the tables of an encoder.
+ * @param encoder The encoder to free.
+ */
+void freeEncoder(pxEncoder *encoder) {
+    free(encoder->coordinates);
+    free(encoder->lengths);
+    encoder->coordinates = NULL;
+    encoder->lengths = NULL;
+    encoder->count = 0;
+}
+
+/**
+ * Write the PX line of a pixel whose color has already been converted to hex.
+ * With alpha-aware encoding opaque pixels are sent as rrggbb and fully transparent ones,
+ * which would not change the canvas, are not sent at all.
+ * @param encoder Encoder whose tables cover x and y.
+ * @param out Output buffer, must have room for MAX_PIXEL_STRING_LENGTH bytes.
+ * @param x X-coordinate of the pixel.
+ * @param y Y-coordinate of the pixel.
+ * @param hex The 8 hex digits of the pixel's color.
+ * @param alpha Alpha channel of the pixel.
+ * @return Number of bytes written.
+ */
+static inline size_t writeLine(pxEncoder *encoder, char *out, int x, int y, const char *hex, unsigned char alpha) {
+    char *it = out;
+    int alphaAware = encoder->options.alphaAware;
+
+    encoder->stats.pixels++;
+    if (alphaAware && alpha == 0) {
+        encoder->stats.skipped++;
+        encoder->stats.savedBytes += 3 + encoder->lengths[x] + encoder->lengths[y] + 9;
+        return 0;
+    }
+    if (encoder->originX != 0 || encoder->originY != 0) {
+        int relativeX = x - encoder->originX, relativeY = y - encoder->originY;
+        encoder->stats.relativeBytes += encoder->lengths[x] + encoder->lengths[y]
+                                      - encoder->lengths[relativeX] - encoder->lengths[relativeY];
+        x = relativeX;
+        y = relativeY;
+    }
+
+    memcpy(it, "PX ", 3);
+    it += 3;
+    // Copy whole slots, the bytes past the coordinate are overwritten by what follows
+    memcpy(it, encoder->coordinates[x], COORDINATE_SLOT);
+    it += encoder->lengths[x];
+    memcpy(it, encoder->coordinates[y], COORDINATE_SLOT);
+    it += encoder->lengths[y];
+
+    if (alphaAware && alpha == 255) {
+        memcpy(it, hex, 6);
+        it[6] = '\n';
+        it += 7;
+        encoder->stats.shortened++;
+        encoder->stats.savedBytes += 2;
+    } else {
+        memcpy(it, hex, 8);
+        it[8] = '\n';
+        it += 9;
+    }
+    return it - out;
+}
+
+/**
+ * Write the binary PB command of a pixel.
+ * Fully transparent pixels are skipped with alpha-aware encoding, there is no shorter form of
+ * opaque pixels since every field has a fixed width.
+ * @param encoder Encoder whose tables cover x and y.
+ * @param out Output buffer, must have room for PB_COMMAND_LENGTH bytes.
+ * @param x X-coordinate of the pixel.
+ * @param y Y-coordinate of the pixel.
+ * @param c Color of the pixel.
+ * @return Number of bytes written.
+ */
+static inline size_t writeBinary(pxEncoder *encoder, char *out, int x, int y, const color *c) {
+    encoder->stats.pixels++;
+    if (encoder->options.alphaAware && c->a == 0) {
+        encoder->stats.skipped++;
+        encoder->stats.savedBytes += PB_COMMAND_LENGTH;
+        return 0;
+    }
+
+    unsigned char *it = (unsigned char*)out;
+    it[0] = 'P';
+    it[1] = 'B';
+    it[2] = (unsigned char)(x & 0xff);
+    it[3] = (unsigned char)(x >> 8);
+    it[4] = (unsigned char)(y & 0xff);
+    it[5] = (unsigned char)(y >> 8);
+    memcpy(it + 6, c, 4);
+    encoder->stats.binaryBytes += 3 + encoder->lengths[x] + encoder->lengths[y] + 9 - PB_COMMAND_LENGTH;
+    return PB_COMMAND_LENGTH;
+}
+
+/**
+ * Write an `OFFSET <x> <y>\n` line, after which the server adds x and y to every PX coordinate.
+ * Pixels encoded afterwards keep their absolute coordinates, the encoder makes them relative.
+ * @param encoder Encoder whose tables cover x and y.
+ * @param out Output buffer, must have room for MAX_OFFSET_STRING_LENGTH bytes.
+ * @param x X-coordinate of the new origin.
+ * @param y Y-coordinate of the new origin.
+ * @return Number of bytes written.
+ */
+size_t encodeOffset(pxEncoder *encoder, char *out, int x, int y) {
+    char *it = out;
+    memcpy(it, "OFFSET ", 7);
+    it += 7;
+    memcpy(it, encoder->coordinates[x], COORDINATE_SLOT);
+    it += encoder->lengths[x];
+    memcpy(it, encoder->coordinates[y], COORDINATE_SLOT);
+    it += encoder->lengths[y];
+    // Replace the space after y with the newline
+    it[-1] = '\n';
+
+    encoder->originX = x;
+    encoder->originY = y;
+    encoder->stats.offsets++;
+    encoder->stats.relativeBytes -= it - out;
+    return it - out;
+}
+
+/**
+ * Encode a pixel as a `PX <x> <y> <rrggbbaa>\n` line.
+ * Without alpha-aware encoding this produces exactly the same bytes as snprintf based formatting.
+ * With binary encoding the pixel is written as a PB command instead.
+ * @param encoder Encoder whose tables cover x and y.
+ * @param out Output buffer, must have room for MAX_PIXEL_STRING_LENGTH bytes.
+ * @param x X-coordinate of the pixel.
+ * @param y Y-coordinate of the pixel.
+ * @param c Color of the pixel.
+ * @return Number of bytes written.
+ */
+size_t encodePixel(pxEncoder *encoder, char *out, int x, int y, const color *c) {
+    if (encoder->options.binary) {
+        return writeBinary(encoder, out, x, y, c);
+    }
+    char hex[8];
+    hexifyScalar(c, hex, 1);
+    return writeLine(encoder, out, x, y, hex, c->a);
+}
+
+/**
+ * Encode a horizontal run of pixels as PX lines.
+ * The colors are converted to hex in blocks by the vector kernel, then interleaved with the
+ * precomputed coordinates. With binary encoding the run is written as PB commands instead.
+ * @param encoder Encoder whose tables cover every coordinate of the run.
+ * @param out Output buffer, must have room for count * MAX_PIXEL_STRING_LENGTH bytes.
+ * @param x X-coordinate of the first pixel.
+ * @param y Y-coordinate of the run.
+ * @param row Colors of the run.
+ * @param count Number of pixels in the run.
+ * @return Number of bytes written.
+ */
+size_t encodeRow(pxEncoder *encoder, char *out, int x, int y, const color *row, int count) {
+    char hex[HEX_BLOCK * 8];
+    char *it = out;
+    int block, i;
+
+    if (encoder->options.binary) {
+        for (i = 0; i < count; i++) {
+            it += writeBinary(encoder, it, x + i, y, &row[i]);
+        }
+        return it - out;
+    }
+    for (block = 0; block < count; block += HEX_BLOCK) {
+        int n = count - block < HEX_BLOCK ? count - block : HEX_BLOCK;
+        encoder->hexify(row + block, hex, n);
+
+        for (i = 0; i < n; i++) {
+            it += writeLine(encoder, it, x + block + i, y, hex + i * 8, row[block + i].a);
+        }
+    }
+    return it - out;
+}
@@ -0,0 +1,53 @@
+#ifndef ENCODER_H_
+#define ENCODER_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../pixutils/pixutils.h"
+
+#define COORDINATE_SLOT 8 // Bytes per precomputed coordinate, enough for "65535 " and copied whole
+#define MAX_COORDINATE 65535
+#define HEX_BLOCK 64 // Pixels converted to hex per kernel call when encoding rows
+#define PB_COMMAND_LENGTH 10 // "PB", x and y as little-endian uint16, then r, g, b, a
+#define MAX_OFFSET_STRING_LENGTH 24 // "OFFSET 65535 65535\n" and the slack of copying whole slots
+
+// [STRUCTURES]
+/**
+ * Structure to represent what the encoder saved compared to always sending rrggbbaa.
+ */
+typedef struct {
+    unsigned long long pixels;     // Pixels handed to the encoder
+    unsigned long long skipped;    // Fully transparent pixels that were dropped
+    unsigned long long shortened;  // Opaque pixels sent as rrggbb
+    unsigned long long savedBytes; // Bytes not sent thanks to the above
+    unsigned long long offsets;    // OFFSET lines written
+    long long relativeBytes;       // Bytes saved by relative coordinates, net of the OFFSET lines
+    long long binaryBytes;         // Bytes saved by PB commands compared to rrggbbaa PX lines
+} encoderStats;
+
+/**
+ * Structure to represent a table-driven PX line encoder.
+ * The decimal strings of every coordinate are precomputed once, so encoding a pixel is
+ * nothing but fixed size copies and table lookups instead of a snprintf call.
+ */
+typedef struct {
+    char (*coordinates)[COORDINATE_SLOT]; // "<n> " for every coordinate n
+    unsigned char *lengths;               // Length of every coordinate string, including the space
+    int count;                            // Number of precomputed coordinates
+    int originX, originY;                 // Corner set by the last OFFSET, subtracted from every coordinate
+    void (*hexify)(const color *in, char *out, int count); // Fastest hex kernel the CPU supports
+    const char *kernel;                   // Name of that kernel
+    encoderOptions options;
+    encoderStats stats;
+} pxEncoder;
+// END OF [STRUCTURES]
+
+// [FUNCTION DECLARATIONS]
+int initEncoder(pxEncoder *encoder, int maxCoordinate, const encoderOptions *options);
+void freeEncoder(pxEncoder *encoder);
+size_t encodeOffset(pxEncoder *encoder, char *out, int x, int y);
+size_t encodePixel(pxEncoder *encoder, char *out, int x, int y, const color *c);
+size_t encodeRow(pxEncoder *encoder, char *out, int x, int y, const color *row, int count);
+// END OF [FUNCTION DECLARATIONS]
+#endif
@@ -3,7 +3,14 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "pixutils.h"
+#include "../encoder/encoder.h"
 #include "../client/client.h"
 #include "../log/log.h"
 
@@ -11,73 +18,469 @@
 #include "../stb_image/stb_image_resize2.h"
 
 /**
- * Divides an image into the specified number of chunks.
+ * Divides an image into rectangular tiles.
  *
- * This function takes an image and a chunk count as input, and divides the image into that many chunks.
- * Each chunk is represented by a `chunk` struct, which contains a start and end pointer (pointing to the image data),
- * and x, y coordinates representing the top-left corner of the chunk in the image.
+ * The tiles are laid out row by row and cover the whole image. Tiles in the last column and row
+ * are narrower or shorter when the image size is not a multiple of the tile size.
  *
- * @param image The image to be divided into chunks.
- * @param chunkCount The number of chunks to divide the image into.
- * @return A pointer to an array of `chunk` structs, each representing a chunk of the image.
- */
-chunk* makeChunks(image image, int chunkCount) {
-    chunk* chunks = (chunk*)malloc(chunkCount * sizeof(chunk));
-    int chunkSize = image.width / chunkCount;
-    log_info("[*] CHUNK SIZE: %d\n", chunkSize);
-    int i;
-    for (i = 0; i < chunkCount; i++) {
-        int start = i * chunkSize;
-        int end = start + chunkSize;
-        chunks[i] = (chunk){
-            .x = 0,
-            .y = i * chunkSize,
-            .start = (color*)(image.originalImage + start * image.width * DEFAULT_CHANNELS),
-            .end = (color*)(image.originalImage + end * image.width * DEFAULT_CHANNELS),
-        };
-    }
-    return chunks;
-}
-
-void processChunk(void* args_) {
-    // Unpack arguments
-    processArgs* args = (processArgs*)args_;
-    image image = args->image;
-    chunk chunk = args->chunk;
-    SOCKET client = args->client;
+ * @param image The image to be divided into tiles.
+ * @param tileWidth Width of a tile in pixels.
+ * @param tileHeight Height of a tile in pixels.
+ * @param tileCount Receives the number of tiles.
+ * @return A pointer to an array of `tile` structs, or NULL if memory could not be allocated.
+ */
+tile* makeTiles(image image, int tileWidth, int tileHeight, int *tileCount) {
+    int columns = (image.width + tileWidth - 1) / tileWidth;
+    int rows = (image.height + tileHeight - 1) / tileHeight;
+    *tileCount = columns * rows;
+
+    tile* tiles = (tile*)malloc(*tileCount * sizeof(tile));
+    if (tiles == NULL) {
+        log_error("[-] Unable to allocate memory for %d tiles\n", *tileCount);
+        return NULL;
+    }
+    log_info("[*] TILE SIZE: %dx%d, TILES: %d\n", tileWidth, tileHeight, *tileCount);
+
+    int row, column;
+    for (row = 0; row < rows; row++) {
+        for (column = 0; column < columns; column++) {
+            tile* it = &tiles[row * columns + column];
+            it->x = column * tileWidth;
+            it->y = row * tileHeight;
+            it->width = image.width - it->x < tileWidth ? image.width - it->x : tileWidth;
+            it->height = image.height - it->y < tileHeight ? image.height - it->y : tileHeight;
+        }
+    }
+    return tiles;
+}
+
+/**
+ * Clip tiles to the canvas of the server, which discards every pixel that falls off it.
+ * Tiles entirely off the canvas are dropped, the remaining ones keep their order.
+ * @param tiles The tiles to clip in place.
+ * @param tileCount Number of tiles.
+ * @param canvasWidth Width of the canvas.
+ * @param canvasHeight Height of the canvas.
+ * @return The number of tiles left.
+ */
+int clipTiles(tile *tiles, int tileCount, int canvasWidth, int canvasHeight) {
+    long long clipped = 0;
+    int i, kept = 0;
+    for (i = 0; i < tileCount; i++) {
+        tile it = tiles[i];
+        int width = canvasWidth - it.x < it.width ? canvasWidth - it.x : it.width;
+        int height = canvasHeight - it.y < it.height ? canvasHeight - it.y : it.height;
+        if (width < 0) {
+            width = 0;
+        }
+        if (height < 0) {
+            height = 0;
+        }
+        clipped += (long long)it.width * it.height - (long long)width * height;
+        if (width == 0 || height == 0) {
+            continue;
+        }
+        it.width = width;
+        it.height = height;
+        tiles[kept++] = it;
+    }
+    if (clipped > 0) {
+        log_info("[*] Clipped %lld pixels off the %dx%d canvas, %d of %d tiles left\n",
+                 clipped, canvasWidth, canvasHeight, kept, tileCount);
+    }
+    return kept;
+}
+
+/**
+ * Initialize a scheduler over a number of tiles.
+ * @param scheduler The scheduler to initialize.
+ * @param tileCount Number of tiles to hand out.
+ * @param loop Set to start over with the first tile after the last one until the scheduler is stopped.
+ */
+void initScheduler(tileScheduler *scheduler, int tileCount, int loop) {
+    atomic_init(&scheduler->next, 0);
+    atomic_init(&scheduler->stopped, 0);
+    atomic_init(&scheduler->reported, 0);
+    scheduler->count = tileCount;
+    scheduler->loop = loop;
+    clock_gettime(CLOCK_MONOTONIC, &scheduler->started);
+}
+
+/**
+ * Take the next tile from a scheduler. Safe to call from any number of threads.
+ * @param scheduler The scheduler to take from.
+ * @return Index of the tile, or -1 once every tile has been handed out or the scheduler was stopped.
+ */
+int nextTile(tileScheduler *scheduler) {
+    if (atomic_load_explicit(&scheduler->stopped, memory_order_relaxed)) {
+        return -1;
+    }
+    unsigned long long handedOut = atomic_fetch_add_explicit(&scheduler->next, 1, memory_order_relaxed);
+    if (handedOut < (unsigned long long)scheduler->count) {
+        return (int)handedOut;
+    }
+    if (!scheduler->loop) {
+        return -1;
+    }
+
+    int index = (int)(handedOut % scheduler->count);
+    if (index == scheduler->count - 1) {
+        unsigned long long passes = handedOut / scheduler->count + 1;
+        double elapsed = schedulerElapsed(scheduler);
+        long long second = (long long)elapsed;
+        long long reported = atomic_load(&scheduler->reported);
+        if (second > reported && atomic_compare_exchange_strong(&scheduler->reported, &reported, second)) {
+            log_info("[*] Pass %llu handed out, %.2f passes/sec\n", passes, passes / elapsed);
+        }
+    }
+    return index;
+}
+
+/**
+ * Stop handing out tiles. Workers finish the tile they are sending and return.
+ * Only stores to an atomic, so it is safe to call from a signal handler.
+ * @param scheduler The scheduler to stop.
+ */
+void stopScheduler(tileScheduler *scheduler) {
+    atomic_store(&scheduler->stopped, 1);
+}
+
+/**
+ * Get the number of complete passes over the tiles handed out so far.
+ * @param scheduler The scheduler to read.
+ * @return Number of passes.
+ */
+unsigned long long schedulerPasses(tileScheduler *scheduler) {
+    unsigned long long handedOut = atomic_load(&scheduler->next);
+    if (!scheduler->loop && handedOut > (unsigned long long)scheduler->count) {
+        handedOut = scheduler->count; // Workers asking after the last tile do not count
+    }
+    return handedOut / scheduler->count;
+}
+
+/**
+ * Get the time since a scheduler was initialized.
+ * @param scheduler The scheduler to read.
+ * @return Elapsed time in seconds.
+ */
+double schedulerElapsed(tileScheduler *scheduler) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - scheduler->started.tv_sec) + (now.tv_nsec - scheduler->started.tv_nsec) / 1e9;
+}
 
+/**
+ * Encode every pixel of the image into a compiled frame.
+ *
+ * The PX commands of each tile are written back to back into one contiguous buffer,
+ * and the offset of every tile is recorded so the buffer can be sliced per tile.
+ *
+ * @param image The image to encode.
+ * @param tiles The tiles the frame is sliced into.
+ * @param tileCount The number of tiles.
+ * @param options How the pixels are encoded.
+ * @return The compiled frame. Its data is NULL if memory could not be allocated.
+ */
+frame compileFrame(image image, tile *tiles, int tileCount, const encoderOptions *options) {
+    frame frame = {0};
     color* colorImage = (color*)image.originalImage;
-    int x, y;
-
-    char pixelBuffer[MAX_PIXEL_STRING_LENGTH * 100]; // buffer for multiple pixels
-    int bufferIndex = 0;
-    int maxBufIndex = sizeof(pixelBuffer) - MAX_PIXEL_STRING_LENGTH;
-    for (color* it = chunk.start; it < chunk.end; it++) {
-        int index = it - (color*)image.originalImage;
-        x = (index % image.width);
-        y = index / image.width;
-        bufferIndex += snprintf(
-            pixelBuffer,
-            MAX_PIXEL_STRING_LENGTH,
-            "PX %d %d %02x%02x%02x%02x\n", 
-            x, 
-            y, 
-            it->r, 
-            it->g, 
-            it->b, 
-            it->a
-        );
-
-        if (bufferIndex >= maxBufIndex) {
-            sendMessage(client, pixelBuffer);
-            bufferIndex = 0;
+    size_t pixelCount = 0;
+    int i, row;
+    // PB commands carry fixed-width coordinates, so there is nothing for OFFSET to shorten
+    int relative = options->relative && !options->binary;
+
+    for (i = 0; i < tileCount; i++) {
+        pixelCount += (size_t)tiles[i].width * tiles[i].height;
+    }
+
+    pxEncoder encoder;
+    if (initEncoder(&encoder, image.width > image.height ? image.width : image.height, options) != 0) {
+        return frame;
+    }
+
+    size_t capacity = pixelCount * MAX_PIXEL_STRING_LENGTH;
+    if (relative) {
+        capacity += (size_t)tileCount * MAX_OFFSET_STRING_LENGTH;
+    }
+    frame.data = (char*)malloc(capacity);
+    frame.offsets = (uint64_t*)malloc((tileCount + 1) * sizeof(uint64_t));
+    if (frame.data == NULL || frame.offsets == NULL) {
+        log_error("[-] Unable to allocate memory for the compiled frame\n");
+        freeFrame(&frame);
+        freeEncoder(&encoder);
+        return frame;
+    }
+    frame.tileCount = tileCount;
+    frame.encoding = (relative ? FRAME_RELATIVE : 0) | (options->binary ? FRAME_BINARY : 0);
+    frame.width = image.width;
+    frame.height = image.height;
+
+    for (i = 0; i < tileCount; i++) {
+        frame.offsets[i] = frame.size;
+        // Every tile sets its own origin, so it is correct whichever connection sends it
+        if (relative) {
+            frame.size += encodeOffset(&encoder, frame.data + frame.size, tiles[i].x, tiles[i].y);
+        }
+        // Encode the tile one row at a time so the vector kernels get whole runs
+        for (row = tiles[i].y; row < tiles[i].y + tiles[i].height; row++) {
+            color* start = colorImage + (size_t)row * image.width + tiles[i].x;
+            frame.size += encodeRow(&encoder, frame.data + frame.size, tiles[i].x, row, start, tiles[i].width);
+        }
+    }
+    frame.offsets[tileCount] = frame.size;
+
+    log_info("[*] Compiled frame: %zu pixels, %zu bytes\n", pixelCount, frame.size);
+    if (options->alphaAware && !options->binary) {
+        log_info("[*] Alpha-aware encoding saved %llu bytes (%llu transparent pixels skipped, %llu opaque pixels shortened)\n",
+                 encoder.stats.savedBytes, encoder.stats.skipped, encoder.stats.shortened);
+    }
+    if (options->binary) {
+        log_info("[*] Binary encoding saved %lld bytes over %llu PB commands\n",
+                 encoder.stats.binaryBytes, encoder.stats.pixels - encoder.stats.skipped);
+    }
+    if (relative) {
+        log_info("[*] Relative coordinates saved %lld bytes net of %llu OFFSET lines\n",
+                 encoder.stats.relativeBytes, encoder.stats.offsets);
+    }
+    freeEncoder(&encoder);
+    return frame;
+}
+
+/**
+ * Get the slice of a compiled frame that belongs to a tile.
+ * @param frame The compiled frame.
+ * @param tileIndex Index of the tile.
+ * @param length Receives the length of the slice in bytes.
+ * @return A pointer to the first byte of the slice.
+ */
+const char* frameSlice(frame *frame, int tileIndex, size_t *length) {
+    *length = (size_t)(frame->offsets[tileIndex + 1] - frame->offsets[tileIndex]);
+    return frame->data + frame->offsets[tileIndex];
+}
+
+/**
+ * Release the memory held by a compiled frame, or unmap it if it was loaded from a file.
+ * @param frame The frame to free.
+ */
+void freeFrame(frame *frame) {
+    if (frame->mapping != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(frame->mapping);
+#else
+        munmap(frame->mapping, frame->mappingSize);
+#endif
+    } else {
+        free(frame->data);
+        free(frame->offsets);
+    }
+    frame->data = NULL;
+    frame->offsets = NULL;
+    frame->mapping = NULL;
+    frame->size = frame->mappingSize = 0;
+    frame->tileCount = 0;
+}
+
+/**
+ * Write a compiled frame to a .cflf file, so it can be replayed later without decoding and encoding the image again.
+ * @param frame The frame to save.
+ * @param path Path of the file to write.
+ * @return 0 on success, -1 on failure.
+ */
+int saveFrame(frame *frame, const char *path) {
+    cflfHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CFLF_MAGIC, sizeof(header.magic));
+    header.version = CFLF_VERSION;
+    header.width = frame->width;
+    header.height = frame->height;
+    header.tileCount = frame->tileCount;
+    header.encoding = frame->encoding;
+    header.dataSize = frame->size;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        log_error("[-] Could not open <%s> for writing\n", path);
+        return -1;
+    }
+    size_t offsetCount = frame->tileCount + 1;
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(frame->offsets, sizeof(uint64_t), offsetCount, file) == offsetCount &&
+             fwrite(frame->data, 1, frame->size, file) == frame->size;
+    if (fclose(file) != 0 || !ok) {
+        log_error("[-] Could not write compiled frame to <%s>\n", path);
+        return -1;
+    }
+    log_info("[*] Saved compiled frame to <%s> (%d tiles, %zu bytes)\n", path, frame->tileCount, frame->size);
+    return 0;
+}
+
+/**
+ * Check whether a file is a compiled frame by looking at its magic.
+ * @param path Path of the file.
+ * @return 1 if the file starts with CFLF_MAGIC, 0 otherwise.
+ */
+int isFrameFile(const char *path) {
+    char magic[4];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    int match = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, CFLF_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return match;
+}
+
+/**
+ * Map a .cflf file read-only and use it as a compiled frame.
+ * The pages are shared by every process replaying the same file and only loaded as they are sent.
+ * @param frame Receives the mapped frame.
+ * @param path Path of the file to map.
+ * @return 0 on success, -1 if the file could not be mapped or is not a valid compiled frame.
+ */
+int mapFrame(frame *frame, const char *path) {
+    void *mapping = NULL;
+    size_t size = 0;
+    memset(frame, 0, sizeof(*frame));
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        log_error("[-] Could not open compiled frame <%s>\n", path);
+        return -1;
+    }
+    LARGE_INTEGER fileSize;
+    HANDLE mappingHandle = NULL;
+    if (GetFileSizeEx(file, &fileSize)) {
+        size = (size_t)fileSize.QuadPart;
+        mappingHandle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mappingHandle != NULL) {
+        mapping = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mappingHandle); // The view keeps the mapping alive
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_error("[-] Could not open compiled frame <%s>\n", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = (size_t)st.st_size;
+        mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            mapping = NULL;
         }
+    }
+    close(fd);
+#endif
+    if (mapping == NULL) {
+        log_error("[-] Could not map compiled frame <%s>\n", path);
+        return -1;
+    }
+    frame->mapping = mapping;
+    frame->mappingSize = size;
+
+    // Validate the header and the tile index before trusting any offset
+    const cflfHeader *header = (const cflfHeader*)mapping;
+    size_t indexSize = 0;
+    int valid = size >= sizeof(cflfHeader) &&
+                memcmp(header->magic, CFLF_MAGIC, sizeof(header->magic)) == 0 &&
+                (header->version == 1 || header->version == CFLF_VERSION) &&
+                header->tileCount > 0 && header->tileCount < INT_MAX;
+    if (valid) {
+        indexSize = (header->tileCount + (size_t)1) * sizeof(uint64_t);
+        valid = size - sizeof(cflfHeader) >= indexSize &&
+                size - sizeof(cflfHeader) - indexSize >= header->dataSize;
+    }
+    if (valid) {
+        frame->offsets = (uint64_t*)((char*)mapping + sizeof(cflfHeader));
+        frame->data = (char*)mapping + sizeof(cflfHeader) + indexSize;
+        frame->size = (size_t)header->dataSize;
+        frame->tileCount = (int)header->tileCount;
+        frame->width = (int)header->width;
+        frame->height = (int)header->height;
+        frame->encoding = header->version == 1 ? 0 : (int)header->encoding;
+
+        uint32_t i;
+        for (i = 0; valid && i < header->tileCount; i++) {
+            valid = frame->offsets[i] <= frame->offsets[i + 1];
+        }
+        valid = valid && frame->offsets[header->tileCount] <= header->dataSize;
+    }
+    if (!valid) {
+        log_error("[-] <%s> is not a valid compiled frame\n", path);
+        freeFrame(frame);
+        return -1;
+    }
+
+    log_info("[*] Mapped compiled frame <%s>: %dx%d, %d tiles, %zu bytes of %s commands\n",
+             path, frame->width, frame->height, frame->tileCount, frame->size,
+             frame->encoding & FRAME_BINARY ? "PB" : frame->encoding & FRAME_RELATIVE ? "relative PX" : "PX");
+    return 0;
+}
+
+/**
+ * Send tiles of the compiled frame over one connection until the scheduler runs out of tiles.
+ * Tiles are taken on demand, so a slow connection sends fewer tiles instead of stalling a fixed share of the image.
+ * @param args_ Pointer to the `processArgs` of the connection.
+ */
+void processTiles(void* args_) {
+    // Unpack arguments
+    processArgs* args = (processArgs*)args_;
+    int tileIndex;
+    unsigned long long tiles = 0;
 
-        if (bufferIndex > 0) {
-            sendMessage(client, pixelBuffer);
+    writer writer;
+    if (initWriter(&writer, args->client, args->bufferSize) != 0) {
+        return;
+    }
+    if (args->zerocopy) {
+        writerEnableZeroCopy(&writer);
+    }
+
+    while ((tileIndex = nextTile(args->scheduler)) >= 0) {
+        size_t length;
+        const char* slice = frameSlice(args->frame, tileIndex, &length);
+        // The frame outlives every task, so tiles are sent straight from it without being copied
+        if (writerSendPinned(&writer, slice, length) == SOCKET_ERROR) {
+            log_error("[!] Failed to send tile %d\n", tileIndex);
+            break;
         }
+        tiles++;
+    }
+    if (writerFlush(&writer) == SOCKET_ERROR) {
+        log_error("[!] Failed to flush connection\n");
+    }
+    log_info("[*] Sent %llu tiles (%.2f passes), %llu bytes in %llu send() calls\n",
+             tiles, (double)tiles / args->scheduler->count, writer.total.bytes, writer.total.syscalls);
+    freeWriter(&writer);
+    if (writer.zerocopy) {
+        log_info("[*] %llu zero-copy sends, %llu sent from pinned pages, %llu copied\n",
+                 writer.pinned.sends, writer.pinned.zerocopied, writer.pinned.copied);
     }
 }
+
+/**
+ * Payload callback for the event-driven engines.
+ * Hands whichever connection is ready the frame slice of the next tile.
+ * @param connection Index of the connection.
+ * @param data Receives a pointer to the slice.
+ * @param length Receives the length of the slice in bytes.
+ * @param context Array of `processArgs`, one per connection.
+ * @return 1 if a slice was stored, 0 once every tile has been handed out.
+ */
+int nextTilePayload(int connection, const char **data, size_t *length, void *context) {
+    processArgs* args = (processArgs*)context + connection;
+    int tileIndex = nextTile(args->scheduler);
+    if (tileIndex < 0) {
+        return 0;
+    }
+    *data = frameSlice(args->frame, tileIndex, length);
+    return 1;
+}
+
 /**
  * Load image from file.
  * @param filename Path to file.
@@ -6,10 +6,21 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
-#include <winsock.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "../client/client.h"
 #define MAX_PIXEL_STRING_LENGTH 30
 #define DEFAULT_CHANNELS 4
 
+#define DEFAULT_TILE_SIZE 64
+
+#define CFLF_MAGIC "CFLF"
+#define CFLF_VERSION 2
+
+// Encodings a frame can be compiled with, stored in its .cflf header
+#define FRAME_RELATIVE 1 // Tiles start with OFFSET and use relative coordinates
+#define FRAME_BINARY 2   // Pixels are binary PB commands instead of PX lines
+
 // [STRUCTURES]
 /**
  * Structure to represent a color.
@@ -28,25 +39,94 @@ typedef struct {
 } image;
 
 /**
- * Structure to represent a chunk of an image.
- * A chunk is represented by its start and end pointers (to the image) , and its x, y coordinates.
+ * Structure to represent a rectangular tile of an image.
+ * A tile is represented by the x, y coordinates of its top-left pixel and its width and height.
  */
 typedef struct {
-    color *start, *end;
     int x, y;
-} chunk;
+    int width, height;
+} tile;
+
+/**
+ * Structure to represent a scheduler handing out tiles to workers on demand.
+ * Whoever asks next gets the next tile, so fast connections simply end up sending more tiles.
+ * When looping, the scheduler starts over with the first tile after the last one until it is stopped.
+ */
+typedef struct {
+    atomic_ullong next;      // Number of tiles handed out so far
+    int count;               // Number of tiles
+    int loop;                // Set to keep handing out passes over the tiles
+    atomic_int stopped;      // Set once no more tiles should be handed out
+    atomic_llong reported;   // Second of the last pass report, passes are reported at most once per second
+    struct timespec started; // When the scheduler was initialized
+} tileScheduler;
+
+/**
+ * Structure to represent how pixels are encoded into PX commands.
+ */
+typedef struct {
+    int alphaAware; // Send rrggbb for opaque pixels and skip fully transparent ones
+    int relative;   // Start every tile with OFFSET and send coordinates relative to its corner
+    int binary;     // Send binary PB commands instead of PX lines, takes precedence over relative
+} encoderOptions;
+
+/**
+ * Structure to represent a compiled frame.
+ * Every pixel of an image is encoded once into a single contiguous PX command buffer,
+ * which is sliced per tile so it can be replayed without formatting it again.
+ */
+typedef struct {
+    char *data;        // Contiguous PX (or PB) command stream
+    size_t size;       // Size of the command stream in bytes
+    uint64_t *offsets; // tileCount + 1 offsets, tile i spans [offsets[i], offsets[i + 1])
+    int tileCount;
+    int width, height; // Dimensions of the encoded image
+    int encoding;      // FRAME_* flags the frame was compiled with
+    void *mapping;     // Start of the mapped .cflf file the frame lives in, NULL if allocated
+    size_t mappingSize;
+} frame;
+
+/**
+ * Header of a compiled frame file (.cflf).
+ * It is followed by tileCount + 1 tile offsets, then by dataSize bytes of commands.
+ * All fields are stored in the byte order of the machine that compiled the frame.
+ */
+typedef struct {
+    char magic[4];      // CFLF_MAGIC
+    uint32_t version;   // CFLF_VERSION
+    uint32_t width;
+    uint32_t height;
+    uint32_t tileCount;
+    uint32_t encoding;  // FRAME_* flags, version 1 files only hold PX lines and store 0
+    uint64_t dataSize;
+} cflfHeader;
 
 typedef struct {
-    image image;
-    chunk chunk;
-    SOCKET client;
+    frame *frame;
+    tileScheduler *scheduler; // Shared by every connection
+    transport *client;
+    size_t bufferSize; // Size of the writer buffer used to send the tiles
+    int zerocopy;      // Set to send the tiles with MSG_ZEROCOPY
 } processArgs;
 // END OF [STRUCTURES]
 
 // [FUNCTION DECLARATIONS]
 image loadImage(char* filename);
 void resizeImage(image *image, int width, int height, int channels);
-chunk* makeChunks(image image, int chunk_count);
-void processChunk(void* args_);
+tile* makeTiles(image image, int tileWidth, int tileHeight, int *tileCount);
+int clipTiles(tile *tiles, int tileCount, int canvasWidth, int canvasHeight);
+void initScheduler(tileScheduler *scheduler, int tileCount, int loop);
+int nextTile(tileScheduler *scheduler);
+void stopScheduler(tileScheduler *scheduler);
+unsigned long long schedulerPasses(tileScheduler *scheduler);
+double schedulerElapsed(tileScheduler *scheduler);
+frame compileFrame(image image, tile *tiles, int tileCount, const encoderOptions *options);
+const char* frameSlice(frame *frame, int tileIndex, size_t *length);
+void freeFrame(frame *frame);
+int saveFrame(frame *frame, const char *path);
+int isFrameFile(const char *path);
+int mapFrame(frame *frame, const char *path);
+void processTiles(void* args_);
+int nextTilePayload(int connection, const char **data, size_t *length, void *context);
 // END OF [FUNCTION DECLARATIONS]
 #endif
\ No newline at end of file
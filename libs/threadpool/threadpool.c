@@ -34,9 +34,29 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
+#endif
 
 #include "threadpool.h"
 
+/**
+ * Capacity of the deque of every worker, must be a power of two
+ */
+#define DEQUE_SIZE 4096
+#define DEQUE_MASK (DEQUE_SIZE - 1)
+#define CACHE_LINE 64
+
 /**
  * How thread pool closes
  */
@@ -51,6 +71,7 @@ typedef enum {
  *
  *  @var function Pointer to the function that will perform the task.
  *  @var argument Argument to be passed to the function.
+ *  @var group    Group the task belongs to, or NULL.
  */
 /**
  * Definition of a task in thread pool
@@ -59,15 +80,104 @@ typedef enum {
 typedef struct {
     void (*function)(void *);
     void *argument;
+    threadpool_group_t *group;
 } threadpool_task_t;
 
+/**
+ *  @struct threadpool_group
+ *  @brief a set of tasks that can be waited for
+ *
+ *  @var pool    The pool running the tasks.
+ *  @var lock    Mutex protecting the wait on done.
+ *  @var done    Condition variable signaled when the last pending task finishes.
+ *  @var pending Number of tasks added to the group that have not finished yet.
+ */
+struct threadpool_group_t {
+    threadpool_t *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    atomic_int pending;
+};
+
+/**
+ *  @struct threadpool_deque
+ *  @brief Chase-Lev work-stealing deque
+ *
+ *  @var top    Index of the oldest task, advanced by thieves.
+ *  @var bottom Index of the next free slot, only moved by the owner.
+ *  @var buffer Ring of DEQUE_SIZE tasks.
+ */
+/**
+ * Only the worker owning the deque pushes and takes at the bottom, without any lock.
+ * Every other worker steals from the top with a single compare-and-swap.
+ * top and bottom sit on their own cache lines so thieves do not slow the owner down.
+ */
+typedef struct {
+    atomic_long top;
+    char pad0[CACHE_LINE - sizeof(atomic_long)];
+    atomic_long bottom;
+    char pad1[CACHE_LINE - sizeof(atomic_long)];
+    threadpool_task_t *buffer;
+} threadpool_deque_t;
+
+/**
+ *  @struct threadpool_cell
+ *  @brief one slot of the lock-free ring
+ *
+ *  @var sequence Tells producers and consumers whose turn it is to use the slot.
+ *  @var task     The task stored in the slot.
+ */
+typedef struct {
+    atomic_size_t sequence;
+    threadpool_task_t task;
+} threadpool_cell_t;
+
+/**
+ *  @struct threadpool_ring
+ *  @brief Bounded multi-producer multi-consumer queue (Vyukov)
+ *
+ *  @var cells       Array of mask + 1 slots.
+ *  @var mask        Number of slots minus one, the number of slots is a power of two.
+ *  @var enqueue_pos Position of the next slot to fill, claimed by producers.
+ *  @var dequeue_pos Position of the next slot to empty, claimed by consumers.
+ */
+/**
+ * Producers and consumers each claim a position with one compare-and-swap and never wait on each other,
+ * a slot is handed over by bumping its sequence once its task is written or read.
+ */
+typedef struct {
+    threadpool_cell_t *cells;
+    size_t mask;
+    char pad0[CACHE_LINE];
+    atomic_size_t enqueue_pos;
+    char pad1[CACHE_LINE - sizeof(atomic_size_t)];
+    atomic_size_t dequeue_pos;
+    char pad2[CACHE_LINE - sizeof(atomic_size_t)];
+} threadpool_ring_t;
+
+/**
+ *  @struct threadpool_worker
+ *  @brief the state of one worker thread
+ *
+ *  @var pool  The pool which owns the worker.
+ *  @var deque Tasks of the worker, which idle workers may steal.
+ *  @var seed  State of the generator picking the first victim to steal from.
+ */
+typedef struct {
+    threadpool_t *pool;
+    threadpool_deque_t deque;
+    unsigned int seed;
+} threadpool_worker_t;
+
 /**
  *  @struct threadpool
  *  @brief The threadpool struct
  *
  *  @var notify       Condition variable to notify worker threads.
  *  @var threads      Array containing worker threads ID.
+ *  @var workers      Array containing the state of every worker.
  *  @var thread_count Number of threads
+ *  @var worker_count Number of workers
  *  @var queue        Array containing the task queue.
  *  @var queue_size   Size of the task queue.
  *  @var head         Index of the first element.
@@ -75,48 +185,494 @@ typedef struct {
  *  @var count        Number of pending tasks
  *  @var shutdown     Flag indicating if the pool is shutting down
  *  @var started      Number of started threads
+ *  @var idle         Number of workers sleeping on notify
+ *  @var flags        Flags the pool was created with
+ *  @var ring         Lock-free task queue used instead of queue with threadpool_lockfree
+ *  @var wake_seq     Futex idle workers park on with threadpool_lockfree
+ *  @var not_full     Condition variable producers wait on while the queue is full.
+ *  @var blocked      Number of producers waiting for room in the queue
+ *  @var space_seq    Futex producers wait on while the ring is full
  */
 /**
  * Structural Definition of Thread Pool
  *  @var lock         Mutex Locks for Internal Work
  *  @var notify       Conditional variables for interthread notifications
  *  @var threads      Thread array, represented here by pointer, array name = first element pointer
+ *  @var workers      Worker array, one deque per thread
  *  @var thread_count Number of threads
- *  @var queue        An array of stored tasks, namely task queues
+ *  @var worker_count Number of workers, fixed before any thread is started
+ *  @var queue        Injection queue for tasks added from outside the pool, namely task queues
  *  @var queue_size   Task queue size
  *  @var head         The first task position in the task queue (Note: All tasks in the task queue are not running)
  *  @var tail         Next location of the last task in the task queue (note: queues are stored in arrays, and head and tail indicate queue location)
  *  @var count        The number of tasks in the task queue, that is, the number of tasks waiting to run
  *  @var shutdown     Indicates whether the thread pool is closed
  *  @var started      Number of threads started
+ *  @var idle         Number of threads waiting for work, so producers only take the lock when someone needs waking
+ *  @var flags        Creation flags, threadpool_lockfree selects ring instead of queue
+ *  @var ring         Lock-free bounded task queue, producers never take the lock
+ *  @var wake_seq     Bumped on every wake-up, idle workers sleep on it while it keeps the value they saw
+ *  @var not_full     Conditional variable blocking producers wait on until tasks leave the queue
+ *  @var blocked      Number of producers waiting for room, consumers only signal when it is not 0
+ *  @var space_seq    Bumped whenever tasks leave the ring while producers wait, they sleep on it like wake_seq
  */
 struct threadpool_t {
   pthread_mutex_t lock;
   pthread_cond_t notify;
   pthread_t *threads;
+  threadpool_worker_t *workers;
   threadpool_task_t *queue;
   int thread_count;
+  int worker_count;
   int queue_size;
   int head;
   int tail;
   int count;
-  int shutdown;
+  atomic_int shutdown;
   int started;
+  atomic_int idle;
+  int flags;
+  threadpool_ring_t ring;
+  atomic_uint wake_seq;
+  pthread_cond_t not_full;
+  atomic_int blocked;
+  atomic_uint space_seq;
 };
 
 /**
- * @function void *threadpool_thread(void *threadpool)
+ * The worker the calling thread runs, NULL outside of any pool
+ */
+static _Thread_local threadpool_worker_t *current_worker;
+
+/**
+ * @function void *threadpool_thread(void *worker)
  * @brief the worker thread
- * @param threadpool the pool which own the thread
+ * @param worker the worker run by the thread
  */
 /**
  * Functions in the thread pool where each thread is running
  * Declare that static should only be used to make functions valid in this file
  */
-static void *threadpool_thread(void *threadpool);
+static void *threadpool_thread(void *worker);
 
 int threadpool_free(threadpool_t *pool);
 
+static int threadpool_find(threadpool_worker_t *worker, threadpool_task_t *task);
+static void threadpool_run(threadpool_task_t *task);
+static void threadpool_discard(threadpool_t *pool);
+static void threadpool_group_finish(threadpool_group_t *group, int count);
+
+/**
+ * Push a task at the bottom of a deque. Only the owner of the deque may call this.
+ * Returns 0 on success, -1 if the deque is full
+ */
+static int deque_push(threadpool_deque_t *deque, threadpool_task_t task)
+{
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if(b - t >= DEQUE_SIZE) {
+        return -1;
+    }
+    deque->buffer[b & DEQUE_MASK] = task;
+    /* Publish the task before the new bottom */
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Take the newest task from the bottom of a deque. Only the owner of the deque may call this.
+ * Returns 1 if a task was taken, 0 if the deque is empty
+ */
+static int deque_take(threadpool_deque_t *deque, threadpool_task_t *task)
+{
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    long t;
+    int taken = 0;
+
+    /* Reserve the bottom slot before looking at top, thieves see the reservation */
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if(t <= b) {
+        *task = deque->buffer[b & DEQUE_MASK];
+        taken = 1;
+        if(t == b) {
+            /* Last task, race the thieves for it */
+            if(!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                        memory_order_seq_cst,
+                                                        memory_order_relaxed)) {
+                taken = 0;
+            }
+            atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        /* Empty, undo the reservation */
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return taken;
+}
+
+/**
+ * Steal the oldest task from the top of a deque. Any thread may call this.
+ * Returns 1 if a task was stolen, 0 if the deque is empty, -1 if another thread won the race
+ */
+static int deque_steal(threadpool_deque_t *deque, threadpool_task_t *task)
+{
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if(t >= b) {
+        return 0;
+    }
+    threadpool_task_t stolen = deque->buffer[t & DEQUE_MASK];
+    if(!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                memory_order_seq_cst,
+                                                memory_order_relaxed)) {
+        return -1;
+    }
+    *task = stolen;
+    return 1;
+}
+
+/**
+ * Allocate a ring with room for at least size tasks
+ * Returns 0 on success, -1 if memory could not be allocated
+ */
+static int ring_init(threadpool_ring_t *ring, int size)
+{
+    size_t capacity = 1, i;
+
+    while(capacity < (size_t)size) {
+        capacity <<= 1;
+    }
+    ring->cells = (threadpool_cell_t *)malloc(sizeof(threadpool_cell_t) * capacity);
+    if(ring->cells == NULL) {
+        return -1;
+    }
+    for(i = 0; i < capacity; i++) {
+        atomic_init(&ring->cells[i].sequence, i);
+    }
+    ring->mask = capacity - 1;
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    return 0;
+}
+
+/**
+ * Add a task to a ring. Any thread may call this.
+ * Returns 0 on success, -1 if the ring is full
+ */
+static int ring_push(threadpool_ring_t *ring, threadpool_task_t task)
+{
+    threadpool_cell_t *cell;
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+
+    for(;;) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0) {
+            /* The slot is free, claim it */
+            if(atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed)) {
+                break;
+            }
+        } else if(diff < 0) {
+            /* The slot still holds a task from the previous lap */
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->task = task;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * Add count tasks running function on each of arguments to a ring, claiming all their slots at once.
+ * Returns 0 on success, -1 if the ring does not have room for all of them
+ */
+static int ring_push_batch(threadpool_ring_t *ring, void (*function)(void *),
+                           void **arguments, int count, threadpool_group_t *group)
+{
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    size_t i;
+
+    do {
+        /* A stale dequeue_pos only makes us more careful */
+        size_t dequeue = atomic_load_explicit(&ring->dequeue_pos, memory_order_acquire);
+        if(pos + count - dequeue > ring->mask + 1) {
+            return -1;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + count,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed));
+
+    for(i = 0; i < (size_t)count; i++) {
+        threadpool_cell_t *cell = &ring->cells[(pos + i) & ring->mask];
+        /* The consumer of the previous lap may still be reading the slot */
+        while(atomic_load_explicit(&cell->sequence, memory_order_acquire) != pos + i) {
+        }
+        cell->task.function = function;
+        cell->task.argument = arguments[i];
+        cell->task.group = group;
+        atomic_store_explicit(&cell->sequence, pos + i + 1, memory_order_release);
+    }
+    return 0;
+}
+
+/**
+ * Take the oldest task from a ring. Any thread may call this.
+ * Returns 1 if a task was taken, 0 if the ring is empty
+ */
+static int ring_pop(threadpool_ring_t *ring, threadpool_task_t *task)
+{
+    threadpool_cell_t *cell;
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+
+    for(;;) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(diff == 0) {
+            /* The slot holds a task, claim it */
+            if(atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed)) {
+                break;
+            }
+        } else if(diff < 0) {
+            /* The slot has not been filled yet */
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    *task = cell->task;
+    /* Hand the slot to the producer of the next lap */
+    atomic_store_explicit(&cell->sequence, pos + ring->mask + 1, memory_order_release);
+    return 1;
+}
+
+/**
+ * Number of tasks claimed in a ring, including ones still being written
+ */
+static size_t ring_size(threadpool_ring_t *ring)
+{
+    size_t dequeue = atomic_load(&ring->dequeue_pos);
+    size_t enqueue = atomic_load(&ring->enqueue_pos);
+    return enqueue > dequeue ? enqueue - dequeue : 0;
+}
+
+/**
+ * Milliseconds left until deadline, 0 once it has passed
+ */
+static long threadpool_remaining(const struct timespec *deadline)
+{
+    struct timespec now;
+    long remaining;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    remaining = (deadline->tv_sec - now.tv_sec) * 1000 +
+                (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return remaining > 0 ? remaining : 0;
+}
+
+/**
+ * Sleep until word no longer holds seq, or until deadline if it is not NULL
+ * Returns right away if it already changed, spurious returns are fine
+ */
+static void threadpool_futex_wait(threadpool_t *pool, atomic_uint *word, unsigned int seq,
+                                  const struct timespec *deadline)
+{
+#ifdef __linux__
+    struct timespec timeout, *relative = NULL;
+    (void)pool;
+    if(deadline != NULL) {
+        long remaining = threadpool_remaining(deadline);
+        timeout.tv_sec = remaining / 1000;
+        timeout.tv_nsec = (remaining % 1000) * 1000000;
+        relative = &timeout;
+    }
+    syscall(SYS_futex, (unsigned int *)word, FUTEX_WAIT_PRIVATE, seq, relative, NULL, 0);
+#elif defined(_WIN32)
+    (void)pool;
+    WaitOnAddress((volatile VOID *)word, &seq, sizeof(seq),
+                  deadline != NULL ? (DWORD)threadpool_remaining(deadline) : INFINITE);
+#else
+    /* No futex, sleep on the condition variable instead */
+    pthread_mutex_lock(&(pool->lock));
+    while(atomic_load(word) == seq) {
+        if(deadline == NULL) {
+            pthread_cond_wait(&(pool->notify), &(pool->lock));
+        } else if(pthread_cond_timedwait(&(pool->notify), &(pool->lock), deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(pool->lock));
+#endif
+}
+
+/**
+ * Bump word and wake up to n threads sleeping on it, n < 0 wakes all of them
+ */
+static void threadpool_futex_wake(threadpool_t *pool, atomic_uint *word, int n)
+{
+    atomic_fetch_add(word, 1);
+#ifdef __linux__
+    (void)pool;
+    syscall(SYS_futex, (unsigned int *)word, FUTEX_WAKE_PRIVATE, n < 0 ? INT32_MAX : n, NULL, NULL, 0);
+#elif defined(_WIN32)
+    (void)pool;
+    if(n == 1) {
+        WakeByAddressSingle((PVOID)word);
+    } else {
+        WakeByAddressAll((PVOID)word);
+    }
+#else
+    /* The condition variable cannot wake a given number of sleepers */
+    (void)n;
+    pthread_mutex_lock(&(pool->lock));
+    pthread_cond_broadcast(&(pool->notify));
+    pthread_mutex_unlock(&(pool->lock));
+#endif
+}
+
+/**
+ * Wake up to n parked workers, n < 0 wakes all of them
+ * Producers call this after publishing their tasks, it costs a single load when nobody is parked
+ */
+static void threadpool_unpark(threadpool_t *pool, int n)
+{
+    /* Pairs with the idle increment of a worker going to park */
+    atomic_thread_fence(memory_order_seq_cst);
+    if(n == 0 || atomic_load(&pool->idle) == 0) {
+        return;
+    }
+    threadpool_futex_wake(pool, &pool->wake_seq, n);
+}
+
+/**
+ * Tell producers blocked on a full queue that tasks were taken from it
+ * The pool lock must be held, unless the pool uses the lock-free ring
+ */
+static void threadpool_made_room(threadpool_t *pool)
+{
+    if(pool->flags & threadpool_lockfree) {
+        /* Pairs with the blocked increment of a producer going to sleep */
+        atomic_thread_fence(memory_order_seq_cst);
+        if(atomic_load(&pool->blocked) > 0) {
+            threadpool_futex_wake(pool, &pool->space_seq, -1);
+        }
+    } else if(atomic_load(&pool->blocked) > 0) {
+        pthread_cond_broadcast(&(pool->not_full));
+    }
+}
+
+/**
+ * Wait until the queue may have room for more tasks
+ * With the mutex queue the pool lock must be held, and is released while waiting.
+ * timeout is 0 to not wait at all, negative to wait for as long as it takes,
+ * and deadline is set when it is positive.
+ * Returns 0 once it is worth trying again, threadpool_queue_full or threadpool_timeout otherwise
+ */
+static int threadpool_wait_room(threadpool_t *pool, int count, int timeout,
+                                const struct timespec *deadline)
+{
+    int err = 0;
+
+    if(timeout == 0) {
+        return threadpool_queue_full;
+    }
+    if(deadline != NULL && threadpool_remaining(deadline) == 0) {
+        return threadpool_timeout;
+    }
+
+    /* A worker must not sleep on its own pool, it may be the one that has to make room */
+    if(current_worker != NULL && current_worker->pool == pool) {
+        threadpool_task_t task;
+        if(!(pool->flags & threadpool_lockfree)) {
+            pthread_mutex_unlock(&(pool->lock));
+        }
+        if(threadpool_find(current_worker, &task)) {
+            threadpool_run(&task);
+        } else {
+            sched_yield();
+        }
+        if(!(pool->flags & threadpool_lockfree)) {
+            pthread_mutex_lock(&(pool->lock));
+        }
+        return 0;
+    }
+
+    if(pool->flags & threadpool_lockfree) {
+        /* Read the futex before announcing we wait, like a worker going to park */
+        unsigned int seq = atomic_load(&pool->space_seq);
+        atomic_fetch_add(&pool->blocked, 1);
+        if(!pool->shutdown && ring_size(&pool->ring) + count > pool->ring.mask + 1) {
+            threadpool_futex_wait(pool, &pool->space_seq, seq, deadline);
+        }
+        atomic_fetch_sub(&pool->blocked, 1);
+        return 0;
+    }
+
+    atomic_fetch_add(&pool->blocked, 1);
+    if(deadline == NULL) {
+        if(pthread_cond_wait(&(pool->not_full), &(pool->lock)) != 0) {
+            err = threadpool_lock_failure;
+        }
+    } else if(pthread_cond_timedwait(&(pool->not_full), &(pool->lock), deadline) == ETIMEDOUT) {
+        err = threadpool_timeout;
+    }
+    atomic_fetch_sub(&pool->blocked, 1);
+    return err;
+}
+
+/**
+ * Check whether any task is waiting, either in the queue or in a deque
+ * The pool lock must be held, unless the pool uses the lock-free ring
+ */
+static int threadpool_has_work(threadpool_t *pool)
+{
+    int i;
+
+    if((pool->flags & threadpool_lockfree) ? ring_size(&pool->ring) > 0 : pool->count > 0) {
+        return 1;
+    }
+    for(i = 0; i < pool->worker_count; i++) {
+        threadpool_deque_t *deque = &pool->workers[i].deque;
+        if(atomic_load(&deque->bottom) > atomic_load(&deque->top)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Wake up to n idle workers
+ * The pool lock must be held
+ */
+static int threadpool_wake(threadpool_t *pool, int n)
+{
+    int idle = atomic_load(&pool->idle);
+
+    if(n > idle) {
+        n = idle;
+    }
+    while(n-- > 0) {
+        if(pthread_cond_signal(&(pool->notify)) != 0) {
+            return threadpool_lock_failure;
+        }
+    }
+    return 0;
+}
+
 threadpool_t *threadpool_create(int thread_count, int queue_size, int flags)
 {
     if(thread_count <= 0 || thread_count > MAX_THREADS || queue_size <= 0 || queue_size > MAX_QUEUE) {
@@ -133,30 +689,60 @@ threadpool_t *threadpool_create(int thread_count, int queue_size, int flags)
 
     /* Initialize */
     pool->thread_count = 0;
+    pool->worker_count = 0;
     pool->queue_size = queue_size;
     pool->head = pool->tail = pool->count = 0;
-    pool->shutdown = pool->started = 0;
+    pool->started = 0;
+    pool->flags = flags;
+    pool->ring.cells = NULL;
+    atomic_init(&pool->shutdown, 0);
+    atomic_init(&pool->idle, 0);
+    atomic_init(&pool->wake_seq, 0);
+    atomic_init(&pool->blocked, 0);
+    atomic_init(&pool->space_seq, 0);
 
     /* Allocate thread and task queue */
     /* Memory required to request thread arrays and task queues */
     pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * thread_count);
-    pool->queue = (threadpool_task_t *)malloc
-        (sizeof(threadpool_task_t) * queue_size);
+    pool->workers = (threadpool_worker_t *)calloc(thread_count, sizeof(threadpool_worker_t));
+    if(flags & threadpool_lockfree) {
+        pool->queue = NULL;
+    } else {
+        pool->queue = (threadpool_task_t *)malloc
+            (sizeof(threadpool_task_t) * queue_size);
+    }
 
     /* Initialize mutex and conditional variable first */
     /* Initialize mutexes and conditional variables */
     if((pthread_mutex_init(&(pool->lock), NULL) != 0) ||
        (pthread_cond_init(&(pool->notify), NULL) != 0) ||
+       (pthread_cond_init(&(pool->not_full), NULL) != 0) ||
        (pool->threads == NULL) ||
-       (pool->queue == NULL)) {
+       (pool->workers == NULL) ||
+       ((flags & threadpool_lockfree) ? ring_init(&pool->ring, queue_size) != 0 : pool->queue == NULL)) {
         goto err;
     }
 
+    /* Give every worker its deque before any thread can steal from it */
+    for(i = 0; i < thread_count; i++) {
+        threadpool_worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->seed = i + 1;
+        atomic_init(&worker->deque.top, 0);
+        atomic_init(&worker->deque.bottom, 0);
+        worker->deque.buffer = (threadpool_task_t *)malloc
+            (sizeof(threadpool_task_t) * DEQUE_SIZE);
+        if(worker->deque.buffer == NULL) {
+            goto err;
+        }
+        pool->worker_count++;
+    }
+
     /* Start worker threads */
     /* Create a specified number of threads to start running */
     for(i = 0; i < thread_count; i++) {
         if(pthread_create(&(pool->threads[i]), NULL,
-                          threadpool_thread, (void*)pool) != 0) {
+                          threadpool_thread, (void*)&pool->workers[i]) != 0) {
             threadpool_destroy(pool, 0);
             return NULL;
         }
@@ -173,14 +759,81 @@ threadpool_t *threadpool_create(int thread_count, int queue_size, int flags)
     return NULL;
 }
 
-int threadpool_add(threadpool_t *pool, void (*function)(void *),
-                   void *argument, int flags)
+/**
+ * Compute the deadline of a submission that may wait timeout milliseconds
+ * Returns deadline, or NULL if the submission does not wait for a limited time
+ */
+static struct timespec *threadpool_deadline(int timeout, struct timespec *deadline)
+{
+    if(timeout <= 0) {
+        return NULL;
+    }
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (long)(timeout % 1000) * 1000000;
+    if(deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+/**
+ * Add a task of group (NULL for none) to the pool
+ * If the queue is full, wait up to timeout milliseconds for room (0 fails right away, negative waits forever)
+ */
+static int threadpool_submit(threadpool_t *pool, void (*function)(void *),
+                             void *argument, threadpool_group_t *group, int timeout)
 {
     int err = 0;
     int next;
+    struct timespec until, *deadline = threadpool_deadline(timeout, &until);
 
-    if(pool == NULL || function == NULL) {
-        return threadpool_invalid;
+    /* Tasks added by a worker of this pool go to its own deque without taking the lock */
+    if(current_worker != NULL && current_worker->pool == pool) {
+        threadpool_task_t task = { function, argument, group };
+        if(deque_push(&current_worker->deque, task) == 0) {
+            if(pool->flags & threadpool_lockfree) {
+                threadpool_unpark(pool, 1);
+                return 0;
+            }
+            /* Pairs with the idle increment of a worker going to sleep */
+            atomic_thread_fence(memory_order_seq_cst);
+            if(atomic_load(&pool->idle) > 0) {
+                if(pthread_mutex_lock(&(pool->lock)) != 0) {
+                    return threadpool_lock_failure;
+                }
+                err = threadpool_wake(pool, 1);
+                if(pthread_mutex_unlock(&pool->lock) != 0) {
+                    err = threadpool_lock_failure;
+                }
+            }
+            return err;
+        }
+        /* The deque is full, fall back to the queue */
+    }
+
+    /* The ring needs no lock, producers only touch the futex if a worker is parked */
+    if(pool->flags & threadpool_lockfree) {
+        threadpool_task_t task = { function, argument, group };
+        for(;;) {
+            if(pool->shutdown) {
+                return threadpool_shutdown;
+            }
+            if(ring_push(&pool->ring, task) == 0) {
+                break;
+            }
+            if((err = threadpool_wait_room(pool, 1, timeout, deadline)) != 0) {
+                return err;
+            }
+        }
+        threadpool_unpark(pool, 1);
+        /* The fence in threadpool_unpark orders this check after the push: either an
+           immediate shutdown drained the ring after it, or we see it and drain it ourselves */
+        if(pool->shutdown == immediate_shutdown) {
+            threadpool_discard(pool);
+        }
+        return 0;
     }
 
     /* Mutual exclusion lock ownership must be acquired first */
@@ -188,15 +841,15 @@ int threadpool_add(threadpool_t *pool, void (*function)(void *),
         return threadpool_lock_failure;
     }
 
-    /* Calculate the next location where task can be stored */
-    next = pool->tail + 1;
-    next = (next == pool->queue_size) ? 0 : next;
-
     do {
         /* Are we full ? */
-        /* Check if the task queue is full */
-        if(pool->count == pool->queue_size) {
-            err = threadpool_queue_full;
+        /* Check if the task queue is full, and wait for room if asked to */
+        while(pool->count == pool->queue_size && !pool->shutdown) {
+            if((err = threadpool_wait_room(pool, 1, timeout, deadline)) != 0) {
+                break;
+            }
+        }
+        if(err != 0) {
             break;
         }
 
@@ -207,10 +860,15 @@ int threadpool_add(threadpool_t *pool, void (*function)(void *),
             break;
         }
 
+        /* Calculate the next location where task can be stored */
+        next = pool->tail + 1;
+        next = (next == pool->queue_size) ? 0 : next;
+
         /* Add task to queue */
         /* Place function pointers and parameters in tail to add to the task queue */
         pool->queue[pool->tail].function = function;
         pool->queue[pool->tail].argument = argument;
+        pool->queue[pool->tail].group = group;
         /* Update tail and count */
         pool->tail = next;
         pool->count += 1;
@@ -239,6 +897,328 @@ int threadpool_add(threadpool_t *pool, void (*function)(void *),
     return err;
 }
 
+/**
+ * Add count tasks of group (NULL for none) to the pool, either all of them or none
+ * If the queue is full, wait up to timeout milliseconds for room like threadpool_submit
+ */
+static int threadpool_submit_batch(threadpool_t *pool, void (*function)(void *),
+                                   void **arguments, int count, threadpool_group_t *group,
+                                   int timeout)
+{
+    int i, err = 0;
+    struct timespec until, *deadline = threadpool_deadline(timeout, &until);
+
+    /* From a worker of this pool, the batch goes to its own deque if it fits */
+    if(current_worker != NULL && current_worker->pool == pool) {
+        threadpool_deque_t *deque = &current_worker->deque;
+        if(atomic_load(&deque->bottom) - atomic_load(&deque->top) + count <= DEQUE_SIZE) {
+            for(i = 0; i < count; i++) {
+                threadpool_task_t task = { function, arguments[i], group };
+                deque_push(deque, task);
+            }
+            if(pool->flags & threadpool_lockfree) {
+                threadpool_unpark(pool, count);
+                return 0;
+            }
+            /* Pairs with the idle increment of a worker going to sleep */
+            atomic_thread_fence(memory_order_seq_cst);
+            if(atomic_load(&pool->idle) > 0) {
+                if(pthread_mutex_lock(&(pool->lock)) != 0) {
+                    return threadpool_lock_failure;
+                }
+                err = threadpool_wake(pool, count);
+                if(pthread_mutex_unlock(&pool->lock) != 0) {
+                    err = threadpool_lock_failure;
+                }
+            }
+            return err;
+        }
+    }
+
+    if(pool->flags & threadpool_lockfree) {
+        /* A batch larger than the ring would never fit */
+        if((size_t)count > pool->ring.mask + 1) {
+            return threadpool_queue_full;
+        }
+        for(;;) {
+            if(pool->shutdown) {
+                return threadpool_shutdown;
+            }
+            if(ring_push_batch(&pool->ring, function, arguments, count, group) == 0) {
+                break;
+            }
+            if((err = threadpool_wait_room(pool, count, timeout, deadline)) != 0) {
+                return err;
+            }
+        }
+        threadpool_unpark(pool, count);
+        if(pool->shutdown == immediate_shutdown) {
+            threadpool_discard(pool);
+        }
+        return 0;
+    }
+
+    /* One critical section for the whole batch */
+    if(pthread_mutex_lock(&(pool->lock)) != 0) {
+        return threadpool_lock_failure;
+    }
+
+    do {
+        /* All or nothing, a partly added batch would be hard to recover from */
+        if(count > pool->queue_size) {
+            err = threadpool_queue_full;
+            break;
+        }
+        while(pool->queue_size - pool->count < count && !pool->shutdown) {
+            if((err = threadpool_wait_room(pool, count, timeout, deadline)) != 0) {
+                break;
+            }
+        }
+        if(err != 0) {
+            break;
+        }
+
+        if(pool->shutdown) {
+            err = threadpool_shutdown;
+            break;
+        }
+
+        for(i = 0; i < count; i++) {
+            pool->queue[pool->tail].function = function;
+            pool->queue[pool->tail].argument = arguments[i];
+            pool->queue[pool->tail].group = group;
+            pool->tail = (pool->tail + 1 == pool->queue_size) ? 0 : pool->tail + 1;
+        }
+        pool->count += count;
+
+        /* Wake as many sleeping workers as there are new tasks, but no more */
+        err = threadpool_wake(pool, count);
+    } while(0);
+
+    if(pthread_mutex_unlock(&pool->lock) != 0) {
+        err = threadpool_lock_failure;
+    }
+
+    return err;
+}
+
+int threadpool_add(threadpool_t *pool, void (*function)(void *),
+                   void *argument, int flags)
+{
+    if(pool == NULL || function == NULL) {
+        return threadpool_invalid;
+    }
+    return threadpool_submit(pool, function, argument, NULL,
+                             (flags & threadpool_block) ? -1 : 0);
+}
+
+int threadpool_add_timed(threadpool_t *pool, void (*function)(void *),
+                         void *argument, int timeout)
+{
+    if(pool == NULL || function == NULL) {
+        return threadpool_invalid;
+    }
+    return threadpool_submit(pool, function, argument, NULL, timeout < 0 ? 0 : timeout);
+}
+
+int threadpool_add_batch(threadpool_t *pool, void (*function)(void *),
+                         void **arguments, int count, int flags)
+{
+    if(pool == NULL || function == NULL || count < 0 || (count > 0 && arguments == NULL)) {
+        return threadpool_invalid;
+    }
+    if(count == 0) {
+        return 0;
+    }
+    return threadpool_submit_batch(pool, function, arguments, count, NULL,
+                                   (flags & threadpool_block) ? -1 : 0);
+}
+
+threadpool_group_t *threadpool_group_create(threadpool_t *pool)
+{
+    threadpool_group_t *group;
+
+    if(pool == NULL) {
+        return NULL;
+    }
+    if((group = (threadpool_group_t *)malloc(sizeof(threadpool_group_t))) == NULL) {
+        return NULL;
+    }
+    group->pool = pool;
+    atomic_init(&group->pending, 0);
+    if(pthread_mutex_init(&(group->lock), NULL) != 0) {
+        free(group);
+        return NULL;
+    }
+    if(pthread_cond_init(&(group->done), NULL) != 0) {
+        pthread_mutex_destroy(&(group->lock));
+        free(group);
+        return NULL;
+    }
+    return group;
+}
+
+int threadpool_group_add(threadpool_group_t *group, void (*function)(void *),
+                         void *argument, int flags)
+{
+    int err;
+
+    if(group == NULL || function == NULL) {
+        return threadpool_invalid;
+    }
+    /* Count the task before it can possibly finish */
+    atomic_fetch_add(&group->pending, 1);
+    if((err = threadpool_submit(group->pool, function, argument, group,
+                                (flags & threadpool_block) ? -1 : 0)) != 0) {
+        /* A waiter may have seen the task counted, let it know it is gone */
+        threadpool_group_finish(group, 1);
+    }
+    return err;
+}
+
+int threadpool_group_add_batch(threadpool_group_t *group, void (*function)(void *),
+                               void **arguments, int count, int flags)
+{
+    int err;
+
+    if(group == NULL || function == NULL || count < 0 || (count > 0 && arguments == NULL)) {
+        return threadpool_invalid;
+    }
+    if(count == 0) {
+        return 0;
+    }
+    atomic_fetch_add(&group->pending, count);
+    if((err = threadpool_submit_batch(group->pool, function, arguments, count, group,
+                                      (flags & threadpool_block) ? -1 : 0)) != 0) {
+        threadpool_group_finish(group, count);
+    }
+    return err;
+}
+
+/**
+ * Mark count tasks of a group as finished, waking its waiters if they were the last ones
+ * Tasks that were discarded or never added count as finished too
+ */
+static void threadpool_group_finish(threadpool_group_t *group, int count)
+{
+    int pending = atomic_load(&group->pending);
+
+    /* Not the last tasks, no waiter can be woken by these */
+    while(pending > count) {
+        if(atomic_compare_exchange_weak(&group->pending, &pending, pending - count)) {
+            return;
+        }
+    }
+
+    /* Possibly the last ones: decrement under the lock, so a waiter cannot return
+       and destroy the group while we still signal it */
+    pthread_mutex_lock(&(group->lock));
+    if(atomic_fetch_sub(&group->pending, count) == count) {
+        pthread_cond_broadcast(&(group->done));
+    }
+    pthread_mutex_unlock(&(group->lock));
+}
+
+/**
+ * Run a task and account for it in its group
+ */
+static void threadpool_run(threadpool_task_t *task)
+{
+    (*(task->function))(task->argument);
+    if(task->group != NULL) {
+        threadpool_group_finish(task->group, 1);
+    }
+}
+
+/**
+ * Throw away every task still queued after an immediate shutdown
+ * Their groups are settled as if they had run, so group waiters do not wait forever.
+ * Safe while workers are still running: deques are only stolen from, the ring is
+ * multi-consumer and the queue is emptied under the lock.
+ */
+static void threadpool_discard(threadpool_t *pool)
+{
+    threadpool_task_t task;
+    int i, res;
+
+    for(i = 0; i < pool->worker_count; i++) {
+        while((res = deque_steal(&pool->workers[i].deque, &task)) != 0) {
+            if(res > 0 && task.group != NULL) {
+                threadpool_group_finish(task.group, 1);
+            }
+        }
+    }
+
+    if(pool->flags & threadpool_lockfree) {
+        while(ring_pop(&pool->ring, &task)) {
+            if(task.group != NULL) {
+                threadpool_group_finish(task.group, 1);
+            }
+        }
+        return;
+    }
+
+    /* One task at a time, group locks are never taken under the pool lock */
+    for(;;) {
+        pthread_mutex_lock(&(pool->lock));
+        if(pool->count == 0) {
+            pthread_mutex_unlock(&(pool->lock));
+            break;
+        }
+        task = pool->queue[pool->head];
+        pool->head = (pool->head + 1 == pool->queue_size) ? 0 : pool->head + 1;
+        pool->count--;
+        pthread_mutex_unlock(&(pool->lock));
+        if(task.group != NULL) {
+            threadpool_group_finish(task.group, 1);
+        }
+    }
+}
+
+int threadpool_group_wait(threadpool_group_t *group)
+{
+    threadpool_task_t task;
+
+    if(group == NULL) {
+        return threadpool_invalid;
+    }
+
+    /* A worker waiting on its own pool helps out instead of blocking,
+       the tasks it waits for may well be sitting in its own deque */
+    if(current_worker != NULL && current_worker->pool == group->pool) {
+        while(atomic_load(&group->pending) > 0 &&
+              threadpool_find(current_worker, &task)) {
+            threadpool_run(&task);
+        }
+    }
+
+    if(pthread_mutex_lock(&(group->lock)) != 0) {
+        return threadpool_lock_failure;
+    }
+    while(atomic_load(&group->pending) > 0) {
+        pthread_cond_wait(&(group->done), &(group->lock));
+    }
+    if(pthread_mutex_unlock(&(group->lock)) != 0) {
+        return threadpool_lock_failure;
+    }
+    return 0;
+}
+
+int threadpool_group_destroy(threadpool_group_t *group)
+{
+    if(group == NULL) {
+        return threadpool_invalid;
+    }
+    /* Tasks still running would touch the group after it is gone */
+    if(atomic_load(&group->pending) > 0) {
+        return threadpool_shutdown;
+    }
+    pthread_mutex_destroy(&(group->lock));
+    pthread_cond_destroy(&(group->done));
+    free(group);
+    return 0;
+}
+
 int threadpool_destroy(threadpool_t *pool, int flags)
 {
     int i, err = 0;
@@ -267,10 +1247,21 @@ int threadpool_destroy(threadpool_t *pool, int flags)
         /* Wake up all worker threads */
         /* Wake up all threads blocked by dependent variables and release mutexes */
         if((pthread_cond_broadcast(&(pool->notify)) != 0) ||
+           (pthread_cond_broadcast(&(pool->not_full)) != 0) ||
            (pthread_mutex_unlock(&(pool->lock)) != 0)) {
             err = threadpool_lock_failure;
             break;
         }
+        if(pool->flags & threadpool_lockfree) {
+            threadpool_unpark(pool, -1);
+            threadpool_futex_wake(pool, &pool->space_seq, -1);
+        }
+
+        /* Pending tasks will never run, settle their groups now: a worker blocked
+           in threadpool_group_wait would otherwise never let the join below return */
+        if(pool->shutdown == immediate_shutdown) {
+            threadpool_discard(pool);
+        }
 
         /* Join all worker thread */
         /* Waiting for all threads to end */
@@ -279,6 +1270,10 @@ int threadpool_destroy(threadpool_t *pool, int flags)
                 err = threadpool_thread_failure;
             }
         }
+        /* Tasks added by the last running tasks */
+        if(pool->shutdown == immediate_shutdown) {
+            threadpool_discard(pool);
+        }
         /* Also do{...} while(0) structure*/
     } while(0);
 
@@ -292,6 +1287,8 @@ int threadpool_destroy(threadpool_t *pool, int flags)
 
 int threadpool_free(threadpool_t *pool)
 {
+    int i;
+
     if(pool == NULL || pool->started > 0) {
         return -1;
     }
@@ -301,6 +1298,13 @@ int threadpool_free(threadpool_t *pool)
     if(pool->threads) {
         free(pool->threads);
         free(pool->queue);
+        free(pool->ring.cells);
+        if(pool->workers) {
+            for(i = 0; i < pool->worker_count; i++) {
+                free(pool->workers[i].deque.buffer);
+            }
+            free(pool->workers);
+        }
 
         /* Because we allocate pool->threads after initializing the
            mutex and condition variable, we're sure they're
@@ -308,54 +1312,175 @@ int threadpool_free(threadpool_t *pool)
         pthread_mutex_lock(&(pool->lock));
         pthread_mutex_destroy(&(pool->lock));
         pthread_cond_destroy(&(pool->notify));
+        pthread_cond_destroy(&(pool->not_full));
     }
     free(pool);
     return 0;
 }
 
+/**
+ * Try to steal a task from the other workers, starting at a random victim
+ */
+static int threadpool_steal(threadpool_worker_t *worker, threadpool_task_t *task)
+{
+    threadpool_t *pool = worker->pool;
+    int i, start, contended;
+
+    do {
+        contended = 0;
+        /* xorshift, so workers do not all raid the same victim */
+        worker->seed ^= worker->seed << 13;
+        worker->seed ^= worker->seed >> 17;
+        worker->seed ^= worker->seed << 5;
+        start = worker->seed % pool->worker_count;
+
+        for(i = 0; i < pool->worker_count; i++) {
+            threadpool_worker_t *victim = &pool->workers[(start + i) % pool->worker_count];
+            if(victim == worker) {
+                continue;
+            }
+            switch(deque_steal(&victim->deque, task)) {
+                case 1:
+                    return 1;
+                case -1:
+                    contended = 1;
+                    break;
+            }
+        }
+        /* Only give up once every deque was seen empty */
+    } while(contended);
+    return 0;
+}
+
+/**
+ * Take a batch of tasks from the queue: the first one is returned,
+ * the rest go to the worker's deque where idle workers can steal them.
+ * Grabbing a fair share at once keeps workers from queueing up on the lock for every task.
+ */
+static int threadpool_grab(threadpool_worker_t *worker, threadpool_task_t *task)
+{
+    threadpool_t *pool = worker->pool;
+    threadpool_task_t next;
+    int batch, taken;
+
+    if(pool->flags & threadpool_lockfree) {
+        if(!ring_pop(&pool->ring, task)) {
+            return 0;
+        }
+        batch = (int)(ring_size(&pool->ring) / pool->worker_count);
+        for(taken = 0; taken < batch && ring_pop(&pool->ring, &next); taken++) {
+            if(deque_push(&worker->deque, next) != 0) {
+                /* Full deque, run it now rather than lose it */
+                threadpool_run(&next);
+                break;
+            }
+        }
+        threadpool_unpark(pool, taken);
+        threadpool_made_room(pool);
+        return 1;
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    if(pool->count == 0 || pool->shutdown == immediate_shutdown) {
+        pthread_mutex_unlock(&(pool->lock));
+        return 0;
+    }
+
+    batch = pool->count / pool->worker_count;
+    batch = (batch < 1) ? 1 : batch;
+
+    *task = pool->queue[pool->head];
+    pool->head = (pool->head + 1 == pool->queue_size) ? 0 : pool->head + 1;
+    for(taken = 1; taken < batch; taken++) {
+        if(deque_push(&worker->deque, pool->queue[pool->head]) != 0) {
+            break;
+        }
+        pool->head = (pool->head + 1 == pool->queue_size) ? 0 : pool->head + 1;
+    }
+    pool->count -= taken;
+
+    /* Let sleeping workers steal the rest of the batch, and blocked producers fill the queue again */
+    threadpool_wake(pool, taken - 1);
+    threadpool_made_room(pool);
+    pthread_mutex_unlock(&(pool->lock));
+    return 1;
+}
+
+/**
+ * Look for a task: own deque first, then the other workers' deques, then the queue
+ */
+static int threadpool_find(threadpool_worker_t *worker, threadpool_task_t *task)
+{
+    return deque_take(&worker->deque, task) ||
+           threadpool_steal(worker, task) ||
+           threadpool_grab(worker, task);
+}
 
-static void *threadpool_thread(void *threadpool)
+static void *threadpool_thread(void *argument)
 {
-    threadpool_t *pool = (threadpool_t *)threadpool;
+    threadpool_worker_t *worker = (threadpool_worker_t *)argument;
+    threadpool_t *pool = worker->pool;
     threadpool_task_t task;
 
+    current_worker = worker;
+
     for(;;) {
+        if(pool->shutdown == immediate_shutdown) {
+            /* The task we just ran may have added more to our deque */
+            threadpool_discard(pool);
+            pthread_mutex_lock(&(pool->lock));
+            break;
+        }
+
+        if(threadpool_find(worker, &task)) {
+            /* Get to work */
+            /* Start running tasks */
+            threadpool_run(&task);
+            continue;
+        }
+
+        if(pool->flags & threadpool_lockfree) {
+            /* Read the futex before announcing we are idle, a wake-up after this is never lost */
+            unsigned int seq = atomic_load(&pool->wake_seq);
+            atomic_fetch_add(&pool->idle, 1);
+            if(!pool->shutdown && !threadpool_has_work(pool)) {
+                threadpool_futex_wait(pool, &pool->wake_seq, seq, NULL);
+            }
+            atomic_fetch_sub(&pool->idle, 1);
+
+            if((pool->shutdown == immediate_shutdown) ||
+               ((pool->shutdown == graceful_shutdown) &&
+                !threadpool_has_work(pool))) {
+                pthread_mutex_lock(&(pool->lock));
+                break;
+            }
+            continue;
+        }
+
         /* Lock must be taken to wait on conditional variable */
         /* Get mutex resources */
         pthread_mutex_lock(&(pool->lock));
 
+        /* Announce that we are idle before looking again, producers pushing
+           to a deque check idle after pushing, so no wake-up is lost */
+        atomic_fetch_add(&pool->idle, 1);
         /* Wait on condition variable, check for spurious wakeups.
            When returning from pthread_cond_wait(), we own the lock. */
-        /* The purpose of using while is to re-examine the condition during wake-up. */
-        while((pool->count == 0) && (!pool->shutdown)) {
-            /* The task queue is empty and the thread pool is blocked when it is not closed */
+        while(!pool->shutdown && !threadpool_has_work(pool)) {
             pthread_cond_wait(&(pool->notify), &(pool->lock));
         }
+        atomic_fetch_sub(&pool->idle, 1);
 
         /* Closing Processing */
         if((pool->shutdown == immediate_shutdown) ||
            ((pool->shutdown == graceful_shutdown) &&
-            (pool->count == 0))) {
+            !threadpool_has_work(pool))) {
             break;
         }
 
-        /* Grab our task */
-        /* Get the first task in the task queue */
-        task.function = pool->queue[pool->head].function;
-        task.argument = pool->queue[pool->head].argument;
-        /* Update head and count */
-        pool->head += 1;
-        pool->head = (pool->head == pool->queue_size) ? 0 : pool->head;
-        pool->count -= 1;
-
         /* Unlock */
         /* Release mutex */
         pthread_mutex_unlock(&(pool->lock));
-
-        /* Get to work */
-        /* Start running tasks */
-        (*(task.function))(task.argument);
-        /* Here is the end of a task run */
     }
 
     /* Threads will end, update the number of running threads */
@@ -364,4 +1489,4 @@ static void *threadpool_thread(void *threadpool)
     pthread_mutex_unlock(&(pool->lock));
     pthread_exit(NULL);
     return(NULL);
-}
\ No newline at end of file
+}
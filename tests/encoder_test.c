@@ -0,0 +1,240 @@
+/**
+ * Correctness test and microbenchmark of the table-driven PX encoder.
+ * Every hex kernel the CPU supports is compared byte for byte against snprintf, for plain,
+ * alpha-aware, relative (OFFSET) and binary (PB) encoding, then timed against snprintf.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -o encoder_test tests/encoder_test.c libs/log/log.c && ./encoder_test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The kernels are private to the encoder, so it is compiled into the test
+#include "../libs/encoder/encoder.c"
+
+#define ROW_LENGTH (MAX_COORDINATE + 1)
+#define BENCH_PIXELS (1 << 22)
+
+typedef struct {
+    const char *name;
+    void (*hexify)(const color *in, char *out, int count);
+} kernel;
+
+// Rows covering every coordinate slot width, from "0 " up to the widest "65535 "
+static const int rows[] = { 0, 9, 10, 99, 100, 999, 1000, 9999, 10000, 65534, MAX_COORDINATE };
+
+/**
+ * Encode pixels the way cflut did before the encoder existed, honoring the same options.
+ * @return Number of bytes written.
+ */
+static size_t referenceRow(char *out, int x, int y, int originX, int originY, const color *row, int count,
+                           const encoderOptions *options) {
+    char *it = out;
+    int i;
+    for (i = 0; i < count; i++) {
+        const color *c = &row[i];
+        int px = x + i - originX, py = y - originY;
+        if (options->binary) {
+            if (options->alphaAware && c->a == 0) {
+                continue;
+            }
+            unsigned char command[PB_COMMAND_LENGTH] = {
+                'P', 'B', (x + i) & 0xff, (x + i) >> 8, y & 0xff, y >> 8, c->r, c->g, c->b, c->a
+            };
+            memcpy(it, command, sizeof(command));
+            it += sizeof(command);
+        } else if (options->alphaAware && c->a == 0) {
+            continue;
+        } else if (options->alphaAware && c->a == 255) {
+            it += snprintf(it, MAX_PIXEL_STRING_LENGTH, "PX %d %d %02x%02x%02x\n", px, py, c->r, c->g, c->b);
+        } else {
+            it += snprintf(it, MAX_PIXEL_STRING_LENGTH, "PX %d %d %02x%02x%02x%02x\n", px, py, c->r, c->g, c->b, c->a);
+        }
+    }
+    return it - out;
+}
+
+/**
+ * Fill a row with random colors, with plenty of fully transparent and fully opaque pixels.
+ */
+static void randomRow(color *row, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        int r = rand();
+        row[i].r = (unsigned char)r;
+        row[i].g = (unsigned char)(r >> 8);
+        row[i].b = (unsigned char)(r >> 16);
+        switch (rand() % 4) {
+            case 0: row[i].a = 0; break;
+            case 1: row[i].a = 255; break;
+            default: row[i].a = (unsigned char)rand(); break;
+        }
+    }
+}
+
+/**
+ * Check one kernel and one set of options against the reference on every test row.
+ * @return Number of mismatching rows.
+ */
+static int checkKernel(const kernel *k, const encoderOptions *options, int relative, color *row,
+                       char *expected, char *actual) {
+    pxEncoder encoder;
+    int failures = 0;
+    size_t r;
+
+    if (initEncoder(&encoder, MAX_COORDINATE, options) != 0) {
+        return 1;
+    }
+    encoder.hexify = k->hexify;
+    for (r = 0; r < sizeof(rows) / sizeof(rows[0]); r++) {
+        int y = rows[r];
+        // Relative runs start at an origin inside the row, so both coordinates shrink
+        int originX = relative ? ROW_LENGTH / 2 : 0, originY = relative ? y / 2 : 0;
+        int x = originX, count = ROW_LENGTH - originX;
+        size_t length = 0, reference;
+
+        randomRow(row, count);
+        if (relative) {
+            char offset[MAX_OFFSET_STRING_LENGTH];
+            char line[MAX_OFFSET_STRING_LENGTH];
+            size_t size = encodeOffset(&encoder, offset, originX, originY);
+            int expectedSize = snprintf(line, sizeof(line), "OFFSET %d %d\n", originX, originY);
+            if (size != (size_t)expectedSize || memcmp(offset, line, size) != 0) {
+                printf("  [%s] OFFSET %d %d: got \"%.*s\"\n", k->name, originX, originY, (int)size, offset);
+                failures++;
+            }
+        }
+        length = encodeRow(&encoder, actual, x, y, row, count);
+        reference = referenceRow(expected, x, y, originX, originY, row, count, options);
+        if (length != reference || memcmp(actual, expected, length) != 0) {
+            size_t i = 0;
+            while (i < length && i < reference && actual[i] == expected[i]) {
+                i++;
+            }
+            printf("  [%s] row %d differs at byte %zu (%zu vs %zu bytes)\n", k->name, y, i, length, reference);
+            failures++;
+        }
+
+        // Single pixels take the encodePixel path, check them at both ends of the row
+        char single[MAX_PIXEL_STRING_LENGTH], singleExpected[MAX_PIXEL_STRING_LENGTH];
+        int ends[2] = { x, ROW_LENGTH - 1 }, e;
+        for (e = 0; e < 2; e++) {
+            const color *c = &row[ends[e] - x];
+            size_t got = encodePixel(&encoder, single, ends[e], y, c);
+            size_t want = referenceRow(singleExpected, ends[e], y, originX, originY, c, 1, options);
+            if (got != want || memcmp(single, singleExpected, got) != 0) {
+                printf("  [%s] pixel %d %d differs\n", k->name, ends[e], y);
+                failures++;
+            }
+        }
+    }
+    freeEncoder(&encoder);
+    return failures;
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Time encoding BENCH_PIXELS pixels with a kernel, or with snprintf when the kernel is NULL.
+ */
+static void benchmark(const kernel *k, const encoderOptions *options, color *row, char *out) {
+    pxEncoder encoder;
+    struct timespec start;
+    size_t bytes = 0;
+    int done, y = 0;
+
+    if (initEncoder(&encoder, MAX_COORDINATE, options) != 0) {
+        return;
+    }
+    if (k != NULL) {
+        encoder.hexify = k->hexify;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Rows of 1920 pixels, like a full HD canvas
+    for (done = 0; done < BENCH_PIXELS; done += 1920, y = (y + 1) % 1080) {
+        bytes += k != NULL
+            ? encodeRow(&encoder, out, 0, y, row, 1920)
+            : referenceRow(out, 0, y, 0, 0, row, 1920, options);
+    }
+    double seconds = elapsed(&start);
+    printf("  %-8s %7.2f ns/pixel %8.1f MB/s\n", k != NULL ? k->name : "snprintf",
+           seconds * 1e9 / done, bytes / seconds / 1e6);
+    freeEncoder(&encoder);
+}
+
+int main(void) {
+    kernel kernels[3];
+    int kernelCount = 0, failures = 0, i, v;
+    const struct {
+        const char *name;
+        encoderOptions options;
+        int relative;
+    } variants[] = {
+        { "rrggbbaa", { .alphaAware = 0 }, 0 },
+        { "alpha-aware", { .alphaAware = 1 }, 0 },
+        { "relative", { .alphaAware = 0, .relative = 1 }, 1 },
+        { "relative alpha-aware", { .alphaAware = 1, .relative = 1 }, 1 },
+        { "binary", { .binary = 1 }, 0 },
+        { "binary alpha-aware", { .alphaAware = 1, .binary = 1 }, 0 },
+    };
+
+    log_set_quiet(true);
+    srand(1);
+    kernels[kernelCount++] = (kernel){ "scalar", hexifyScalar };
+#ifdef ENCODER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels[kernelCount++] = (kernel){ "sse2", hexifySSE2 };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[kernelCount++] = (kernel){ "avx2", hexifyAVX2 };
+    }
+#endif
+
+    color *row = malloc(ROW_LENGTH * sizeof(color));
+    char *expected = malloc((size_t)ROW_LENGTH * MAX_PIXEL_STRING_LENGTH);
+    char *actual = malloc((size_t)ROW_LENGTH * MAX_PIXEL_STRING_LENGTH);
+    if (row == NULL || expected == NULL || actual == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    // Coordinates past the widest slot are refused instead of overflowing it
+    pxEncoder encoder;
+    encoderOptions defaults = { .alphaAware = 1 };
+    if (initEncoder(&encoder, 99999, &defaults) == 0) {
+        printf("FAIL: initEncoder accepted coordinate 99999\n");
+        freeEncoder(&encoder);
+        failures++;
+    }
+
+    for (v = 0; v < (int)(sizeof(variants) / sizeof(variants[0])); v++) {
+        for (i = 0; i < kernelCount; i++) {
+            int res = checkKernel(&kernels[i], &variants[v].options, variants[v].relative, row, expected, actual);
+            printf("%s: %s %s\n", res == 0 ? "PASS" : "FAIL", kernels[i].name, variants[v].name);
+            failures += res;
+        }
+    }
+
+    printf("Encoding %d pixels:\n", BENCH_PIXELS);
+    randomRow(row, 1920);
+    for (v = 0; v < 2; v++) {
+        printf(" %s\n", variants[v].name);
+        benchmark(NULL, &variants[v].options, row, actual);
+        for (i = 0; i < kernelCount; i++) {
+            benchmark(&kernels[i], &variants[v].options, row, actual);
+        }
+    }
+
+    free(row);
+    free(expected);
+    free(actual);
+    printf("%s\n", failures == 0 ? "All tests passed" : "Some tests failed");
+    return failures != 0;
+}
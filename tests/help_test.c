@@ -0,0 +1,77 @@
+/**
+ * Test of the HELP text parsing that picks the encoding when probing a server.
+ * Real HELP texts must enable the features they list, and prose that merely contains
+ * words like "PB", "offset" or "alpha" must not enable anything.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -o help_test tests/help_test.c libs/client/transport.c libs/client/posix.c libs/client/udp.c \
+ *       libs/client/winsock.c libs/client/zerocopy.c libs/log/log.c && ./help_test
+ */
+#include <stdio.h>
+#include <string.h>
+
+// The parser is private to the client, so it is compiled into the test
+#include "../libs/client/client.c"
+
+typedef struct {
+    const char *name;
+    const char *text;
+    int offset, binary, alpha;
+} helpCase;
+
+static const helpCase cases[] = {
+    { "pixelnuke",
+      "HELP: Returns a short introductional help text.\n"
+      "SIZE: Returns the size of the visible canvas in pixel as SIZE <w> <h>.\n"
+      "PX <x> <y> Return the current color of a pixel as PX <x> <y> <rrggbb>.\n"
+      "PX <x> <y> <rrggbb(aa)>: Draw a single pixel at position (x, y) with the specified hex color code.\n",
+      0, 0, 1 },
+    { "indented listing",
+      "Pixelflut server\n"
+      "  > PX <x> <y> <rrggbb|rrggbbaa>\n"
+      "  > OFFSET <x> <y>\n"
+      "  - PBxxyyrgba: binary pixel, coordinates as little-endian uint16\n",
+      1, 1, 1 },
+    { "command listing",
+      "Commands: HELP, SIZE, PX, OFFSET, PB\n",
+      1, 1, 0 },
+    { "prose",
+      "Welcome! This server has no PB support and ignores alpha.\n"
+      "Offsets are not supported either, see the offset FAQ.\n"
+      "The PBS documentary about alpha blending is great.\n"
+      "PX <x> <y> <rrggbb>: blending with alpha is not available\n"
+      "PBJ sandwiches are served at the bar\n"
+      "OFFSETS and PB commands may come in a later release\n",
+      0, 0, 0 },
+    { "prose listing",
+      "Commands we will never support: OFFSETS, PBX\n",
+      0, 0, 0 },
+};
+
+int main(void) {
+    int failures = 0;
+    size_t c;
+
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        serverCapabilities capabilities;
+        char line[MAX_RESPONSE_LENGTH];
+        const char *it = cases[c].text;
+
+        ZeroMemory(&capabilities, sizeof(capabilities));
+        while (*it != '\0') {
+            const char *newline = strchr(it, '\n');
+            size_t length = newline - it;
+            memcpy(line, it, length);
+            line[length] = '\0';
+            parseHelpLine(line, &capabilities);
+            it = newline + 1;
+        }
+        int ok = capabilities.offset == cases[c].offset && capabilities.binary == cases[c].binary &&
+                 capabilities.alpha == cases[c].alpha;
+        printf("%s: %s (offset %d, binary %d, alpha %d)\n", ok ? "PASS" : "FAIL", cases[c].name,
+               capabilities.offset, capabilities.binary, capabilities.alpha);
+        failures += !ok;
+    }
+    printf("%s\n", failures == 0 ? "All tests passed" : "Some tests failed");
+    return failures != 0;
+}
@@ -0,0 +1,110 @@
+/**
+ * Contention benchmark of the thread pool queues.
+ * For 1 to 64 threads, as many producer threads as workers flood the pool with tiny tasks,
+ * once through the mutex-protected queue and once through the lock-free ring (-L in cflut).
+ * Every add comes from outside the pool, so it goes through the shared queue rather than a
+ * worker's deque, which is the path cflut's main thread and the epoll/uring engines take.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -pthread -o threadpool_bench tests/threadpool_bench.c libs/threadpool/threadpool.c
+ *   ./threadpool_bench [tasks] [queue_size]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "../libs/threadpool/threadpool.h"
+
+#define DEFAULT_TASKS 1000000
+#define DEFAULT_QUEUE_SIZE 256 // Same as cflut's -q default
+
+typedef struct {
+    threadpool_t *pool;
+    long tasks;
+    int failed;
+} producer;
+
+static atomic_long done;
+
+static void task(void *arg) {
+    (void)arg;
+    atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+}
+
+static void *produce(void *arg) {
+    producer *p = arg;
+    long i;
+    for (i = 0; i < p->tasks; i++) {
+        if (threadpool_add(p->pool, task, NULL, threadpool_block) != 0) {
+            p->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run tasks through a pool of thread_count workers fed by thread_count producers.
+ * @return Millions of tasks per second, or a negative value on failure.
+ */
+static double run(int thread_count, int queue_size, int flags, long tasks) {
+    pthread_t threads[MAX_THREADS];
+    producer producers[MAX_THREADS];
+    struct timespec start, end;
+    int i, started = 0, failed = 0;
+
+    atomic_store(&done, 0);
+    threadpool_t *pool = threadpool_create(thread_count, queue_size, flags);
+    if (pool == NULL) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < thread_count; i++) {
+        producers[i].pool = pool;
+        producers[i].tasks = tasks / thread_count + (i < tasks % thread_count);
+        producers[i].failed = 0;
+        if (pthread_create(&threads[i], NULL, produce, &producers[i]) != 0) {
+            failed = 1;
+            break;
+        }
+        started++;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        failed |= producers[i].failed;
+    }
+    // A graceful shutdown returns once every queued task has run
+    threadpool_destroy(pool, threadpool_graceful);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (failed || atomic_load(&done) != tasks) {
+        return -1;
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return tasks / seconds / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    long tasks = argc > 1 ? atol(argv[1]) : DEFAULT_TASKS;
+    int queue_size = argc > 2 ? atoi(argv[2]) : DEFAULT_QUEUE_SIZE;
+    int thread_count, status = 0;
+
+    if (tasks <= 0 || queue_size <= 0 || queue_size > MAX_QUEUE) {
+        fprintf(stderr, "Usage: %s [tasks] [queue_size <= %d]\n", argv[0], MAX_QUEUE);
+        return 1;
+    }
+    printf("%ld tasks, queue size %d, Mtasks/s\n", tasks, queue_size);
+    printf("%8s %10s %10s %8s\n", "threads", "mutex", "lockfree", "ratio");
+    for (thread_count = 1; thread_count <= MAX_THREADS; thread_count *= 2) {
+        double mutex = run(thread_count, queue_size, 0, tasks);
+        double lockfree = run(thread_count, queue_size, threadpool_lockfree, tasks);
+        if (mutex < 0 || lockfree < 0) {
+            printf("%8d failed\n", thread_count);
+            status = 1;
+            continue;
+        }
+        printf("%8d %10.2f %10.2f %7.2fx\n", thread_count, mutex, lockfree, lockfree / mutex);
+    }
+    return status;
+}